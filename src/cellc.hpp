@@ -10,8 +10,8 @@
 namespace cfq {
 
 struct cellc {
-  sem_t cell_vacant;
-  uint16_t cell_sz;
+  alignas(hardware_destructive_interference_size) sem_t cell_vacant;
+  alignas(hardware_destructive_interference_size) uint16_t cell_sz;
   uint16_t cells_len;
   alignas(hardware_destructive_interference_size) std::byte cells[];
 };
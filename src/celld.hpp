@@ -2,9 +2,11 @@
 
 #include <cstdint>
 
+#include "align.hpp"
+
 namespace cfq {
 
-struct celld {
+struct alignas(hardware_destructive_interference_size) celld {
   uint16_t data_sz;
   uint16_t ncell;
 };
@@ -3,7 +3,6 @@
 #include <climits>
 #include <cstdint>
 
-#include <sstream>
 #include <sys/types.h>
 
 #include <limits>
@@ -31,6 +30,14 @@ enum : uint8_t {
   op_read = 0,
   op_write = 1,
   op_eof = 2,
+  /*
+   * Multiplexing of many files through one channel: op_open binds fid to the
+   * relative path stored in the cells given, op_close releases fid
+   */
+  op_open = 3,
+  op_close = 4,
+  /* Cells given carry fref descriptors instead of data */
+  op_wref = 5,
 
   ops_qty,
 };
@@ -43,12 +50,22 @@ constexpr uint8_t fl_shift = op_bits;
 constexpr uint8_t fl_mask = ~(op_mask);
 constexpr uint8_t fl_bits = CHAR_BIT - op_bits;
 
+enum : uint8_t {
+  /*
+   * The command is being resubmitted after a failure reported through the
+   * completion queue, the consumer resumes carrying commands out from it on
+   */
+  fl_retry = 1 << 0,
+};
+
 struct cmd {
   uint16_t id;
   uint8_t opfl;
   uint8_t reserved1;
   uint16_t fcdn;
   uint16_t cnum;
+  uint16_t fid;
+  uint16_t reserved2;
 
   uint16_t get_id() const noexcept { return id; }
   void set_id(uint16_t v) noexcept { id = v; }
@@ -59,6 +76,9 @@ struct cmd {
   uint16_t get_cnum() const noexcept { return cnum; }
   void set_cnum(uint16_t n) noexcept { cnum = n; }
 
+  uint16_t get_fid() const noexcept { return fid; }
+  void set_fid(uint16_t v) noexcept { fid = v; }
+
   [[nodiscard]] uint_fast32_t get_op() const noexcept {
     return (opfl & op_mask) >> op_shift;
   }
@@ -76,19 +96,26 @@ struct cmd {
   }
 
   friend std::ostream &operator<<(std::ostream &out, cmd const &cmd) {
-    out << fmt::format("cmd: [ id={}, op={}, fl={}, fcdn={}, cnum={} ]",
-                       cmd.get_id(), cmd.get_op(), cmd.get_fl(), cmd.get_fcdn(),
-                       cmd.get_cnum());
+    out << fmt::format(
+        "cmd: [ id={}, op={}, fl={}, fcdn={}, cnum={}, fid={} ]", cmd.get_id(),
+        cmd.get_op(), cmd.get_fl(), cmd.get_fcdn(), cmd.get_cnum(),
+        cmd.get_fid());
     return out;
   }
 };
 
 } // namespace cfq
 
-template <> struct fmt::formatter<cfq::cmd> : fmt::formatter<std::string> {
-  auto format(cfq::cmd const &cmd, format_context &ctx) -> decltype(ctx.out()) {
-    std::ostringstream oss;
-    oss << cmd;
-    return format_to(ctx.out(), "{}", oss.str());
+template <> struct fmt::formatter<cfq::cmd> {
+  constexpr auto parse(format_parse_context &ctx) -> decltype(ctx.begin()) {
+    return ctx.begin();
+  }
+
+  auto format(cfq::cmd const &cmd, format_context &ctx) const
+      -> decltype(ctx.out()) {
+    return format_to(ctx.out(),
+                     "cmd: [ id={}, op={}, fl={}, fcdn={}, cnum={}, fid={} ]",
+                     cmd.get_id(), cmd.get_op(), cmd.get_fl(), cmd.get_fcdn(),
+                     cmd.get_cnum(), cmd.get_fid());
   }
 };
@@ -1,59 +1,349 @@
 #include "consumer.hpp"
 
+#include <cerrno>
 #include <cstddef>
 #include <cstdlib>
+#include <cstring>
 
+#include <fcntl.h>
 #include <unistd.h>
 
-#include <fstream>
-#include <ios>
-#include <limits>
+#include <algorithm>
+#include <array>
+#include <optional>
+#include <string>
+#include <system_error>
 #include <thread>
+#include <unordered_map>
+#include <utility>
 
 #include <spdlog/spdlog.h>
 
-namespace cfq {
+#include "file.hpp"
+#include "fref.hpp"
+#include "mem.hpp"
+#include "trace.hpp"
 
-int consumer(qcmd_t<cmd, uint32_t, uint32_t> &qcmd, std::span<celld> cellds,
-             cellc &cellc, std::filesystem::path const &p) {
-  spdlog::set_pattern("[consumer %P] [%^%l%$]: %v");
+namespace {
 
-  spdlog::info("started: file to write {}", p.string());
+constexpr size_t kWriteBufferSize = 64 * 1024;
 
-  std::ofstream f{p, std::ios::out | std::ios::binary};
-
-  for (bool eof = false; f && !eof;) {
-    spdlog::debug("is working");
-    if (auto const v = qcmd.pop()) [[likely]] {
-      spdlog::debug("processing {} ", *v);
-      switch (auto ncell = v->get_fcdn(); v->get_op()) {
-      case op_write: {
-        auto cells_left = v->get_cnum();
-        for (auto *celld = &cellds[ncell];
-             cells_left > 0 && ncell < cellc.cells_len;
-             celld = &cellds[ncell], --cells_left) {
-
-          f.write(reinterpret_cast<char const *>(cellc.cells +
-                                                 cellc.cell_sz * ncell),
-                  celld->data_sz);
-
-          ncell = celld->ncell;
-
-          sem_post(&cellc.cell_vacant);
-        }
-      } break;
-      default:
-        eof = true;
-        continue;
+/*
+ * Files bound to file ids by op_open, each one is kept open until op_close
+ * unbinds it
+ */
+class file_table {
+public:
+  explicit file_table(std::filesystem::path root) : root_(std::move(root)) {}
+
+  /* Binds fid to path and creates the file right away */
+  void bind(uint16_t fid, std::filesystem::path const &path) {
+    auto full_path = path;
+    if (!root_.empty()) {
+      if (path.is_absolute() ||
+          std::ranges::find(path, "..") != path.end()) {
+        throw std::invalid_argument(
+            fmt::format("path {} escapes root", path.string()));
       }
+      full_path = root_ / path;
+      if (full_path.has_parent_path())
+        std::filesystem::create_directories(full_path.parent_path());
+    }
+    unbind(fid);
+    files_.insert_or_assign(
+        fid, cfq::open(full_path, O_WRONLY | O_CREAT | O_TRUNC, 0644));
+  }
+
+  void unbind(uint16_t fid) noexcept { files_.erase(fid); }
+
+  int get(uint16_t fid) const {
+    auto const it = files_.find(fid);
+    if (it == files_.end())
+      throw std::invalid_argument(fmt::format("unbound fid {}", fid));
+    return *it->second;
+  }
+
+private:
+  std::filesystem::path root_;
+  std::unordered_map<uint16_t, cfq::uptrwd<int const>> files_;
+};
+
+void write_all(int fd, std::byte const *data, size_t sz) {
+  while (sz > 0) {
+    auto const n = ::write(fd, data, sz);
+    if (n < 0) {
+      if (EINTR == errno)
+        continue;
+      throw std::system_error(errno, std::generic_category());
+    }
+    data += n;
+    sz -= n;
+  }
+}
+
+/*
+ * Gathers the data of cells into larger writes, data not smaller than the
+ * buffer goes to the file straight away
+ */
+class write_buffer {
+public:
+  void write(int fd, std::byte const *data, size_t sz) {
+    if (fd != fd_ || len_ + sz > buf_.size())
+      flush();
+
+    if (sz >= buf_.size()) {
+      write_all(fd, data, sz);
+      return;
+    }
+
+    std::memcpy(buf_.data() + len_, data, sz);
+    len_ += sz;
+    fd_ = fd;
+  }
+
+  /* Data buffered is dropped if it fails to be written */
+  void flush() {
+    if (auto const len = std::exchange(len_, 0); len > 0)
+      write_all(fd_, buf_.data(), len);
+  }
+
+private:
+  std::array<std::byte, kWriteBufferSize> buf_;
+  size_t len_ = 0;
+  int fd_ = -1;
+};
+
+/*
+ * Carries out commands, either releasing cells right away or, if there is a
+ * completion queue, leaving it up to the producer that gets cqe per command
+ */
+class executor {
+public:
+  explicit executor(std::span<cfq::celld> cellds, cfq::cellc &cellc,
+                    file_table &fds, std::filesystem::path const &src,
+                    cfq::qcqe_t<cfq::cqe, cfq::kCqesLen> *cq) noexcept
+      : cellds_(cellds), cellc_(cellc), fds_(fds), src_(src), cq_(cq) {}
+
+  /*
+   * Returns the number of bytes written, throws on failure. Without a
+   * completion queue writes are buffered across commands until the file is
+   * closed, the stream ends or another file is written
+   */
+  uint32_t execute(cfq::cmd const &v) {
+    uint32_t bytes = 0;
+
+    switch (v.get_op()) {
+    case cfq::op_write: {
+      int const fd = fds_.get(v.get_fid());
+      transaction(fd, [&] {
+        for_each_cell(v, [&](std::byte const *data, uint16_t data_sz) {
+          out_.write(fd, data, data_sz);
+          bytes += data_sz;
+        });
+      });
+    } break;
+    case cfq::op_wref: {
+      if (!src_map_)
+        src_map_.emplace(src_);
+
+      int const fd = fds_.get(v.get_fid());
+      transaction(fd, [&] {
+        for_each_cell(v, [&](std::byte const *data, uint16_t) {
+          cfq::fref ref;
+          std::memcpy(&ref, data, sizeof(ref));
+
+          auto const fdata = src_map_->get(ref);
+          out_.write(fd, fdata.data(), fdata.size());
+          bytes += fdata.size();
+        });
+      });
+    } break;
+    case cfq::op_open: {
+      std::string path;
+      for_each_cell(v, [&](std::byte const *data, uint16_t data_sz) {
+        path.append(reinterpret_cast<char const *>(data), data_sz);
+      });
+      out_.flush();
+      fds_.bind(v.get_fid(), path);
+    } break;
+    case cfq::op_close:
+      out_.flush();
+      fds_.unbind(v.get_fid());
+      break;
+    default:
+      break;
+    }
+
+    return bytes;
+  }
+
+  void flush() { out_.flush(); }
+
+private:
+  /* Calls f(data, data_sz) for every cell of the command given */
+  template <typename F> void for_each_cell(cfq::cmd const &v, F &&f) {
+    auto ncell = v.get_fcdn();
+    auto cells_left = v.get_cnum();
+    for (auto *celld = &cellds_[ncell];
+         cells_left > 0 && ncell < cellc_.cells_len;
+         celld = &cellds_[ncell], --cells_left) {
+
+      f(cellc_.cells + cellc_.cell_sz * ncell, celld->data_sz);
+
+      ncell = celld->ncell;
+
+      if (!cq_)
+        sem_post(&cellc_.cell_vacant);
+    }
+  }
+
+  /*
+   * Undoes a partial write if f fails so that the command can be retried,
+   * files are only ever appended to. The command is only complete once its
+   * data is written
+   */
+  template <typename F> void transaction(int fd, F &&f) {
+    if (!cq_) {
+      f();
+      return;
+    }
+
+    auto const off = lseek(fd, 0, SEEK_END);
+    try {
+      f();
+      out_.flush();
+    } catch (...) {
+      if (off >= 0 && 0 == ftruncate(fd, off))
+        lseek(fd, off, SEEK_SET);
+      throw;
+    }
+  }
+
+  std::span<cfq::celld> cellds_;
+  cfq::cellc &cellc_;
+  file_table &fds_;
+  std::filesystem::path const &src_;
+  std::optional<cfq::fref_map> src_map_;
+  cfq::qcqe_t<cfq::cqe, cfq::kCqesLen> *cq_;
+  write_buffer out_;
+};
+
+int consume(cfq::qcmd_t<cfq::cmd, cfq::kCmdsLen> &qcmd,
+            std::span<cfq::celld> cellds, cfq::cellc &cellc, file_table &fds,
+            cfq::qcqe_t<cfq::cqe, cfq::kCqesLen> *cq,
+            std::filesystem::path const &src = {}) {
+  executor exec{cellds, cellc, fds, src, cq};
+
+  /*
+   * After a failure reported, commands are cancelled until the producer
+   * resubmits them
+   */
+  bool failed = false;
+
+  for (bool eof = false; !eof;) {
+    auto const v = qcmd.pop();
+    if (!v) [[unlikely]] {
+      std::this_thread::yield();
+      continue;
+    }
+
+    CFQ_TRACE_EVENT(cfq::trace::ev_pop, *v);
+
+    switch (v->get_op()) {
+    case cfq::op_write:
+    case cfq::op_wref:
+    case cfq::op_open:
+    case cfq::op_close:
+      break;
+    default:
+      eof = true;
+      continue;
+    }
+
+    cfq::cqe c{.id = v->get_id(), .status = 0, .bytes = 0};
+
+    if (failed && !(v->get_fl() & cfq::fl_retry)) {
+      c.status = ECANCELED;
     } else {
+      failed = false;
+      try {
+        c.bytes = exec.execute(*v);
+      } catch (std::system_error const &ex) {
+        spdlog::error("failed to carry out {}, reason: {}", *v, ex.what());
+        c.status = ex.code().value();
+      } catch (std::exception const &ex) {
+        spdlog::error("failed to carry out {}, reason: {}", *v, ex.what());
+        c.status = EINVAL;
+      }
+    }
+
+    CFQ_TRACE_EVENT(cfq::trace::ev_done, *v, c.bytes);
+
+    if (!cq) {
+      if (0 != c.status)
+        return EXIT_FAILURE;
+      continue;
+    }
+
+    failed = 0 != c.status;
+
+    while (!cq->push(c))
       std::this_thread::yield();
+  }
+
+  exec.flush();
+
+  return EXIT_SUCCESS;
+}
+
+} // namespace
+
+namespace cfq {
+
+int consumer(qcmd_t<cmd, kCmdsLen> &qcmd, std::span<celld> cellds,
+             cellc &cellc, std::filesystem::path const &p,
+             std::filesystem::path const &src, qcqe_t<cqe, kCqesLen> *cq) {
+  spdlog::info("started: file to write {}", p.string());
+
+  int r = EXIT_FAILURE;
+
+  try {
+    file_table fds{{}};
+    try {
+      fds.bind(0, p);
+    } catch (std::system_error const &ex) {
+      /* The producer learns of it from completions of the writes */
+      if (!cq)
+        throw;
+      spdlog::error("failed to open {}, reason: {}", p.string(), ex.what());
     }
+    r = consume(qcmd, cellds, cellc, fds, cq, src);
+  } catch (std::exception const &ex) {
+    spdlog::error("failed, reason: {}", ex.what());
   }
 
   spdlog::info("finished");
 
-  return EXIT_SUCCESS;
+  return r;
+}
+
+int consumer_tree(qcmd_t<cmd, kCmdsLen> &qcmd, std::span<celld> cellds,
+                  cellc &cellc, std::filesystem::path const &root,
+                  qcqe_t<cqe, kCqesLen> *cq) {
+  spdlog::info("started: root to write {}", root.string());
+
+  int r = EXIT_FAILURE;
+
+  try {
+    file_table fds{root};
+    r = consume(qcmd, cellds, cellc, fds, cq);
+  } catch (std::exception const &ex) {
+    spdlog::error("failed, reason: {}", ex.what());
+  }
+
+  spdlog::info("finished");
+
+  return r;
 }
 
 } // namespace cfq
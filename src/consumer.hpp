@@ -8,9 +8,26 @@
 #include "cellc.hpp"
 #include "celld.hpp"
 #include "cmd.hpp"
+#include "cqe.hpp"
 #include "qcmd.hpp"
 
 namespace cfq {
-int consumer(qcmd_t<cmd, uint32_t, uint32_t> &qcmd, std::span<celld> cellds,
-             cellc &cellc, std::filesystem::path const &p);
-}
+
+/*
+ * Writes the file p, data referenced by op_wref commands is taken from the
+ * source file src mapped on demand. If cq is given every command is
+ * completed through it and cells are left for the producer to release
+ */
+int consumer(qcmd_t<cmd, kCmdsLen> &qcmd, std::span<celld> cellds,
+             cellc &cellc, std::filesystem::path const &p,
+             std::filesystem::path const &src, qcqe_t<cqe, kCqesLen> *cq);
+
+/*
+ * Writes files multiplexed through the channel, paths bound to file ids by
+ * op_open are relative to root
+ */
+int consumer_tree(qcmd_t<cmd, kCmdsLen> &qcmd, std::span<celld> cellds,
+                  cellc &cellc, std::filesystem::path const &root,
+                  qcqe_t<cqe, kCqesLen> *cq);
+
+} // namespace cfq
@@ -0,0 +1,283 @@
+#include "copy.hpp"
+
+#include <cstring>
+
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CFQ_COPY_X86 1
+#else
+#define CFQ_COPY_X86 0
+#endif
+
+#include <unistd.h>
+
+#include <spdlog/spdlog.h>
+
+#include "mapping.hpp"
+
+namespace {
+
+void copy_generic(std::byte *dst, std::byte const *src, size_t n) noexcept {
+  std::memcpy(dst, src, n);
+}
+
+#if CFQ_COPY_X86
+
+/* Bytes to copy first for dst to get aligned to a, a is a power of 2 */
+size_t head_len(std::byte const *dst, size_t n, size_t a) noexcept {
+  return std::min(n, -reinterpret_cast<uintptr_t>(dst) & (a - 1));
+}
+
+[[gnu::target("sse2")]] void copy_sse2(std::byte *dst, std::byte const *src,
+                                       size_t n) noexcept {
+  for (; n >= 64; n -= 64, dst += 64, src += 64) {
+    auto const *s = reinterpret_cast<__m128i const *>(src);
+    auto *d = reinterpret_cast<__m128i *>(dst);
+    auto const v0 = _mm_loadu_si128(s);
+    auto const v1 = _mm_loadu_si128(s + 1);
+    auto const v2 = _mm_loadu_si128(s + 2);
+    auto const v3 = _mm_loadu_si128(s + 3);
+    _mm_storeu_si128(d, v0);
+    _mm_storeu_si128(d + 1, v1);
+    _mm_storeu_si128(d + 2, v2);
+    _mm_storeu_si128(d + 3, v3);
+  }
+  std::memcpy(dst, src, n);
+}
+
+[[gnu::target("sse2")]] void copy_sse2_nt(std::byte *dst, std::byte const *src,
+                                          size_t n) noexcept {
+  auto const head = head_len(dst, n, 16);
+  std::memcpy(dst, src, head);
+  dst += head, src += head, n -= head;
+
+  for (; n >= 64; n -= 64, dst += 64, src += 64) {
+    auto const *s = reinterpret_cast<__m128i const *>(src);
+    auto *d = reinterpret_cast<__m128i *>(dst);
+    auto const v0 = _mm_loadu_si128(s);
+    auto const v1 = _mm_loadu_si128(s + 1);
+    auto const v2 = _mm_loadu_si128(s + 2);
+    auto const v3 = _mm_loadu_si128(s + 3);
+    _mm_stream_si128(d, v0);
+    _mm_stream_si128(d + 1, v1);
+    _mm_stream_si128(d + 2, v2);
+    _mm_stream_si128(d + 3, v3);
+  }
+  for (; n >= 16; n -= 16, dst += 16, src += 16) {
+    _mm_stream_si128(reinterpret_cast<__m128i *>(dst),
+                     _mm_loadu_si128(reinterpret_cast<__m128i const *>(src)));
+  }
+  std::memcpy(dst, src, n);
+
+  _mm_sfence();
+}
+
+[[gnu::target("avx2")]] void copy_avx2(std::byte *dst, std::byte const *src,
+                                       size_t n) noexcept {
+  for (; n >= 128; n -= 128, dst += 128, src += 128) {
+    auto const *s = reinterpret_cast<__m256i const *>(src);
+    auto *d = reinterpret_cast<__m256i *>(dst);
+    auto const v0 = _mm256_loadu_si256(s);
+    auto const v1 = _mm256_loadu_si256(s + 1);
+    auto const v2 = _mm256_loadu_si256(s + 2);
+    auto const v3 = _mm256_loadu_si256(s + 3);
+    _mm256_storeu_si256(d, v0);
+    _mm256_storeu_si256(d + 1, v1);
+    _mm256_storeu_si256(d + 2, v2);
+    _mm256_storeu_si256(d + 3, v3);
+  }
+  std::memcpy(dst, src, n);
+}
+
+[[gnu::target("avx2")]] void copy_avx2_nt(std::byte *dst, std::byte const *src,
+                                          size_t n) noexcept {
+  auto const head = head_len(dst, n, 32);
+  std::memcpy(dst, src, head);
+  dst += head, src += head, n -= head;
+
+  for (; n >= 128; n -= 128, dst += 128, src += 128) {
+    auto const *s = reinterpret_cast<__m256i const *>(src);
+    auto *d = reinterpret_cast<__m256i *>(dst);
+    auto const v0 = _mm256_loadu_si256(s);
+    auto const v1 = _mm256_loadu_si256(s + 1);
+    auto const v2 = _mm256_loadu_si256(s + 2);
+    auto const v3 = _mm256_loadu_si256(s + 3);
+    _mm256_stream_si256(d, v0);
+    _mm256_stream_si256(d + 1, v1);
+    _mm256_stream_si256(d + 2, v2);
+    _mm256_stream_si256(d + 3, v3);
+  }
+  for (; n >= 32; n -= 32, dst += 32, src += 32) {
+    _mm256_stream_si256(
+        reinterpret_cast<__m256i *>(dst),
+        _mm256_loadu_si256(reinterpret_cast<__m256i const *>(src)));
+  }
+  std::memcpy(dst, src, n);
+
+  _mm_sfence();
+}
+
+[[gnu::target("avx512f")]] void
+copy_avx512(std::byte *dst, std::byte const *src, size_t n) noexcept {
+  for (; n >= 256; n -= 256, dst += 256, src += 256) {
+    auto const v0 = _mm512_loadu_si512(src);
+    auto const v1 = _mm512_loadu_si512(src + 64);
+    auto const v2 = _mm512_loadu_si512(src + 128);
+    auto const v3 = _mm512_loadu_si512(src + 192);
+    _mm512_storeu_si512(dst, v0);
+    _mm512_storeu_si512(dst + 64, v1);
+    _mm512_storeu_si512(dst + 128, v2);
+    _mm512_storeu_si512(dst + 192, v3);
+  }
+  std::memcpy(dst, src, n);
+}
+
+[[gnu::target("avx512f")]] void
+copy_avx512_nt(std::byte *dst, std::byte const *src, size_t n) noexcept {
+  auto const head = head_len(dst, n, 64);
+  std::memcpy(dst, src, head);
+  dst += head, src += head, n -= head;
+
+  for (; n >= 256; n -= 256, dst += 256, src += 256) {
+    auto const v0 = _mm512_loadu_si512(src);
+    auto const v1 = _mm512_loadu_si512(src + 64);
+    auto const v2 = _mm512_loadu_si512(src + 128);
+    auto const v3 = _mm512_loadu_si512(src + 192);
+    _mm512_stream_si512(reinterpret_cast<__m512i *>(dst), v0);
+    _mm512_stream_si512(reinterpret_cast<__m512i *>(dst + 64), v1);
+    _mm512_stream_si512(reinterpret_cast<__m512i *>(dst + 128), v2);
+    _mm512_stream_si512(reinterpret_cast<__m512i *>(dst + 192), v3);
+  }
+  for (; n >= 64; n -= 64, dst += 64, src += 64)
+    _mm512_stream_si512(reinterpret_cast<__m512i *>(dst),
+                        _mm512_loadu_si512(src));
+  std::memcpy(dst, src, n);
+
+  _mm_sfence();
+}
+
+#endif
+
+/* Size of the per-core cache, if the system does not tell assume the least */
+size_t l2_cache_size() noexcept {
+  constexpr size_t kDefault = 256 * 1024;
+#ifdef _SC_LEVEL2_CACHE_SIZE
+  if (auto const sz = sysconf(_SC_LEVEL2_CACHE_SIZE); sz > 0)
+    return sz;
+#endif
+  return kDefault;
+}
+
+cfq::copy_kernel probe() noexcept {
+#if CFQ_COPY_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f"))
+    return {cfq::copy_isa::avx512, copy_avx512, copy_avx512_nt};
+  if (__builtin_cpu_supports("avx2"))
+    return {cfq::copy_isa::avx2, copy_avx2, copy_avx2_nt};
+  if (__builtin_cpu_supports("sse2"))
+    return {cfq::copy_isa::sse2, copy_sse2, copy_sse2_nt};
+#endif
+  return {cfq::copy_isa::generic, copy_generic, copy_generic};
+}
+
+} // namespace
+
+namespace cfq {
+
+copy_kernel const &best_copy_kernel() noexcept {
+  static copy_kernel const k = probe();
+  return k;
+}
+
+copy_bench bench_copy(copy_kernel const &k, size_t cell_sz, size_t cells_len) {
+  using clock = std::chrono::steady_clock;
+
+  /* Enough for the cost of the clock and of faulting pages in to be lost */
+  constexpr size_t kBytes = 1 << 20;
+  constexpr int kReps = 3;
+
+  auto const p_cells = map_shared<std::byte>(cell_sz * cells_len);
+  if (!p_cells)
+    return {};
+
+  std::vector<std::byte> const src(cell_sz, std::byte{0x5a});
+  size_t const rounds = std::max<size_t>(kBytes / (cell_sz * cells_len), 1);
+
+  auto const run = [&](copy_kernel::fn fill, size_t nrounds) {
+    uint64_t sum = 0;
+    for (size_t i = 0; i < nrounds; ++i) {
+      for (size_t n = 0; n < cells_len; ++n) {
+        auto *cell = p_cells.get() + cell_sz * n;
+        for (size_t off = 0; off + sizeof(uint64_t) <= cell_sz;
+             off += sizeof(uint64_t)) {
+          uint64_t w;
+          std::memcpy(&w, cell + off, sizeof(w));
+          sum += w;
+        }
+        fill(cell, src.data(), cell_sz);
+      }
+    }
+    return sum;
+  };
+
+  auto const time = [&](copy_kernel::fn fill) {
+    auto const tp = clock::now();
+    [[maybe_unused]] uint64_t volatile sink = run(fill, rounds);
+    return std::chrono::duration<double, std::nano>(clock::now() - tp).count() /
+           (rounds * cells_len);
+  };
+
+  run(k.temporal, 1);
+
+  copy_bench b{
+      .temporal_ns = std::numeric_limits<double>::max(),
+      .streaming_ns = std::numeric_limits<double>::max(),
+  };
+  for (int i = 0; i < kReps; ++i) {
+    b.temporal_ns = std::min(b.temporal_ns, time(k.temporal));
+    b.streaming_ns = std::min(b.streaming_ns, time(k.streaming));
+  }
+
+  return b;
+}
+
+size_t copy_crossover(copy_kernel const &k, size_t cell_sz, size_t cells_len) {
+  auto const none = std::numeric_limits<size_t>::max();
+  if (copy_isa::generic == k.isa)
+    return none;
+
+  /*
+   * Cells that fit in the cache along with the data they are filled from are
+   * read by the consumer from there, regular stores are never worse then
+   */
+  if (cell_sz * cells_len * 2 <= l2_cache_size())
+    return none;
+
+  auto const b = bench_copy(k, cell_sz, cells_len);
+  spdlog::debug("copy: {} cells of {} bytes filled in {:.1f}ns by regular "
+                "stores, in {:.1f}ns by streaming ones",
+                cells_len, cell_sz, b.temporal_ns, b.streaming_ns);
+
+  return b.streaming_ns < b.temporal_ns ? cell_sz : none;
+}
+
+std::string_view to_string(copy_isa isa) noexcept {
+  switch (isa) {
+  case copy_isa::generic:
+    return "generic";
+  case copy_isa::sse2:
+    return "sse2";
+  case copy_isa::avx2:
+    return "avx2";
+  case copy_isa::avx512:
+    return "avx512";
+  }
+  return "unknown";
+}
+
+} // namespace cfq
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include <limits>
+#include <string_view>
+
+namespace cfq {
+
+enum class copy_isa : uint8_t {
+  generic,
+  sse2,
+  avx2,
+  avx512,
+};
+
+/* Copy routines of one instruction set, any alignment and size are taken */
+struct copy_kernel {
+  using fn = void (*)(std::byte *dst, std::byte const *src, size_t n) noexcept;
+
+  copy_isa isa;
+  /* Regular stores, the data stays in the caches of the caller */
+  fn temporal;
+  /*
+   * Non-temporal stores going past the caches to memory, fenced before
+   * returning so that the data is visible before a command is pushed
+   */
+  fn streaming;
+};
+
+/* Kernel of the widest instruction set the CPU supports, probed once */
+copy_kernel const &best_copy_kernel() noexcept;
+
+/* Nanoseconds taken per cell by either kind of stores */
+struct copy_bench {
+  double temporal_ns;
+  double streaming_ns;
+};
+
+/*
+ * Times filling cells_len cells of cell_sz bytes round-robin from a hot
+ * buffer, each cell is read back right before it is filled again as the
+ * consumer would have done it by then
+ */
+copy_bench bench_copy(copy_kernel const &k, size_t cell_sz, size_t cells_len);
+
+/*
+ * Size of fills from which streaming stores are to be used: cell_sz if they
+ * win the benchmark for such cells, otherwise none. The benchmark is only
+ * run for cells that do not fit in the cache
+ */
+size_t copy_crossover(copy_kernel const &k, size_t cell_sz, size_t cells_len);
+
+/* Fills cells with streaming stores from the threshold given on */
+class cell_copier {
+public:
+  explicit cell_copier(
+      size_t nt_threshold = std::numeric_limits<size_t>::max()) noexcept
+      : kernel_(best_copy_kernel()), nt_threshold_(nt_threshold) {}
+
+  void operator()(std::byte *dst, std::byte const *src,
+                  size_t n) const noexcept {
+    (n >= nt_threshold_ ? kernel_.streaming : kernel_.temporal)(dst, src, n);
+  }
+
+private:
+  copy_kernel const &kernel_;
+  size_t const nt_threshold_;
+};
+
+std::string_view to_string(copy_isa isa) noexcept;
+
+} // namespace cfq
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "static_cfq.hpp"
+
+namespace cfq {
+
+constexpr size_t kCqesLen = 32;
+
+/* Completion of a command reported by the consumer back to the producer */
+struct cqe {
+  uint16_t id;
+  /* 0 on success, errno otherwise */
+  uint16_t status;
+  uint32_t bytes;
+};
+
+template <typename T, size_t N> using qcqe_t = static_cfq<T, N>;
+
+} // namespace cfq
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <filesystem>
+#include <span>
+#include <stdexcept>
+
+#include "mapping.hpp"
+#include "mem.hpp"
+
+namespace cfq {
+
+/* Part of a source file either side of a channel maps at once */
+constexpr uint64_t kMmapWindow = uint64_t{64} << 20;
+/* Largest amount of data a single reference stands for */
+constexpr uint32_t kFrefChunk = uint32_t{1} << 20;
+
+static_assert(0 == kMmapWindow % kFrefChunk);
+
+/*
+ * Reference to source file data carried by a cell instead of the data
+ * itself, never crosses a window boundary
+ */
+struct fref {
+  uint64_t offset;
+  uint32_t len;
+  uint32_t reserved;
+};
+
+/* Source file mapped read-only window by window */
+class fref_map {
+public:
+  explicit fref_map(std::filesystem::path path)
+      : path_(std::move(path)), file_sz_(std::filesystem::file_size(path_)) {}
+
+  [[nodiscard]] uint64_t size() const noexcept { return file_sz_; }
+
+  /* Reference to the chunk of data starting at offset given */
+  [[nodiscard]] fref at(uint64_t offset) const noexcept {
+    auto const wend = std::min(window_of(offset) + kMmapWindow, file_sz_);
+    return {
+        .offset = offset,
+        .len = static_cast<uint32_t>(
+            std::min<uint64_t>(wend - offset, kFrefChunk)),
+        .reserved = 0,
+    };
+  }
+
+  /* Maps the window containing ref if it is not mapped yet */
+  std::span<std::byte const> get(fref const &ref) {
+    if (ref.offset + ref.len > file_sz_ ||
+        window_of(ref.offset) != window_of(ref.offset + ref.len - 1)) {
+      throw std::out_of_range("file reference is out of range");
+    }
+
+    if (auto const woff = window_of(ref.offset); !window_ || woff != woff_) {
+      window_.reset();
+
+      auto const wsz = std::min(kMmapWindow, file_sz_ - woff);
+      window_ = map_shared<std::byte const>(wsz, PROT_READ, woff, path_,
+                                            O_RDONLY);
+      if (!window_)
+        throw std::runtime_error("failed to map source file");
+
+      auto *p = const_cast<std::byte *>(window_.get());
+      madvise(p, wsz, MADV_SEQUENTIAL);
+      madvise(p, wsz, MADV_WILLNEED);
+
+      woff_ = woff;
+    }
+
+    return {window_.get() + (ref.offset - woff_), ref.len};
+  }
+
+private:
+  static constexpr uint64_t window_of(uint64_t offset) noexcept {
+    return offset / kMmapWindow * kMmapWindow;
+  }
+
+  std::filesystem::path path_;
+  uint64_t file_sz_;
+  uint64_t woff_ = 0;
+  mem_t<std::byte const> window_;
+};
+
+} // namespace cfq
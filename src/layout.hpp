@@ -0,0 +1,115 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include <limits>
+
+#include "align.hpp"
+#include "cellc.hpp"
+#include "celld.hpp"
+
+namespace cfq {
+
+constexpr size_t kPageSize = 4096;
+
+constexpr size_t align_up(size_t v, size_t a) noexcept {
+  return (v + a - 1) / a * a;
+}
+
+struct region {
+  size_t offset;
+  size_t size;
+
+  [[nodiscard]] constexpr size_t end() const noexcept { return offset + size; }
+};
+
+/*
+ * Places all the structures of a channel in one shared mapping:
+ *
+ *   | cellc, cells | cellds | cq | queue 0 | queue 1 | ... | queue N - 1 |
+ *
+ * each queue being an inline Queue object and cq an inline CQueue object
+ * carrying completions back. Every segment starts on a
+ * cache line of its own. If GuardPages every segment starts on a page and is
+ * followed by a page meant to be protected with PROT_NONE
+ */
+template <typename Queue, typename CQueue, size_t CellSz, size_t CellsLen,
+          bool GuardPages = false>
+struct channel_layout {
+  static constexpr size_t kLine = hardware_destructive_interference_size;
+  static constexpr size_t kSegAlign = GuardPages ? kPageSize : kLine;
+  static constexpr size_t kGuardSz = GuardPages ? kPageSize : 0;
+
+  static constexpr size_t guard(region r) noexcept {
+    return align_up(r.end(), kSegAlign);
+  }
+  static constexpr size_t next(region r) noexcept {
+    return guard(r) + kGuardSz;
+  }
+
+  static constexpr region cellc_region{
+      0, offsetof(cellc, cells) + CellSz * CellsLen};
+  static constexpr region cellds_region{next(cellc_region),
+                                        sizeof(celld) * CellsLen};
+  static constexpr region cq_region{next(cellds_region), sizeof(CQueue)};
+
+  /* Offsets within a queue segment */
+  static constexpr region queue_region{0, sizeof(Queue)};
+
+  static constexpr size_t queues_offset = next(cq_region);
+  static constexpr size_t queue_stride = next(queue_region);
+
+  [[nodiscard]] static constexpr size_t queue(size_t nq) noexcept {
+    return queues_offset + queue_stride * nq;
+  }
+
+  [[nodiscard]] static constexpr size_t size(size_t nqueues) noexcept {
+    return queue(nqueues);
+  }
+
+  /* Calls f(offset) for the offset of every guard page, if any */
+  template <typename F>
+  static constexpr void for_each_guard(size_t nqueues, F &&f) {
+    if constexpr (GuardPages) {
+      f(guard(cellc_region));
+      f(guard(cellds_region));
+      f(guard(cq_region));
+      for (size_t nq = 0; nq < nqueues; ++nq)
+        f(queue(nq) + guard(queue_region));
+    }
+  }
+
+  static_assert(CellsLen > 0 &&
+                CellsLen < std::numeric_limits<uint16_t>::max());
+  static_assert(CellSz > 0 && CellSz <= std::numeric_limits<uint16_t>::max());
+  static_assert(0 == kPageSize % kLine);
+
+  /* Hot fields must not share cache lines */
+  static_assert(0 == sizeof(Queue) % kLine,
+                "queues must not share cache lines with their neighbours");
+  static_assert(0 == sizeof(CQueue) % kLine,
+                "queues must not share cache lines with their neighbours");
+  static_assert(offsetof(cellc, cell_sz) -
+                    offsetof(cellc, cell_vacant) >=
+                kLine);
+  static_assert(0 == offsetof(cellc, cells) % kLine);
+  static_assert(0 == CellSz % kLine, "cells must not share cache lines");
+  static_assert(0 == sizeof(celld) % kLine,
+                "cell descriptors must not share cache lines");
+
+  /* Segments are properly aligned and never overlap */
+  static_assert(alignof(cellc) <= kSegAlign);
+  static_assert(alignof(celld) <= kSegAlign);
+  static_assert(alignof(Queue) <= kSegAlign);
+  static_assert(alignof(CQueue) <= kSegAlign);
+  static_assert(0 == cellds_region.offset % alignof(celld));
+  static_assert(0 == queues_offset % kSegAlign);
+  static_assert(0 == queue_stride % kSegAlign);
+  static_assert(cellc_region.end() + kGuardSz <= cellds_region.offset);
+  static_assert(cellds_region.end() + kGuardSz <= cq_region.offset);
+  static_assert(cq_region.end() + kGuardSz <= queues_offset);
+  static_assert(queue_region.end() + kGuardSz <= queue_stride);
+};
+
+} // namespace cfq
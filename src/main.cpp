@@ -3,20 +3,26 @@
 #include <cstring>
 
 #include <semaphore.h>
+#include <sys/mman.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
 #include <algorithm>
 #include <exception>
 #include <filesystem>
+#include <fstream>
 #include <functional>
+#include <future>
 #include <iostream>
+#include <limits>
 #include <memory>
 #include <new>
+#include <optional>
 #include <ranges>
 #include <stdexcept>
 #include <string>
 #include <string_view>
+#include <system_error>
 #include <type_traits>
 #include <utility>
 #include <vector>
@@ -30,93 +36,217 @@
 
 #include <spdlog/spdlog.h>
 
-#include "cb.hpp"
 #include "cellc.hpp"
 #include "celld.hpp"
-#include "cfqcb.hpp"
 #include "cmd.hpp"
 #include "consumer.hpp"
+#include "copy.hpp"
+#include "cqe.hpp"
+#include "layout.hpp"
 #include "mapping.hpp"
 #include "producer.hpp"
 #include "qcmd.hpp"
+#include "stage.hpp"
+#include "trace.hpp"
+#include "transform.hpp"
 
-constexpr uint16_t kCmdsMax = 5;
 constexpr uint16_t kCellSize = 512;
 constexpr uint16_t kCellsNum = 8;
+constexpr uint8_t kRetries = 3;
+
+#ifndef CFQ_GUARD_PAGES
+#define CFQ_GUARD_PAGES 0
+#endif
+
+using qcmd_t = cfq::qcmd_t<cfq::cmd, cfq::kCmdsLen>;
+using qcqe_t = cfq::qcqe_t<cfq::cqe, cfq::kCqesLen>;
+using layout_t = cfq::channel_layout<qcmd_t, qcqe_t, kCellSize, kCellsNum,
+                                     CFQ_GUARD_PAGES>;
 
-using pcmds_t = cfq::uptrwd<cfq::cmd>;
-using pcelld_t = cfq::uptrwd<cfq::celld>;
-using pcellc_t = cfq::uptrwd<cfq::cellc>;
 using pcellcs_t = std::shared_ptr<cfq::cellc>;
 
 namespace {
 
 void show_help(std::string_view program) {
-  std::cout << fmt::format("{} <path/from>:<path/to> <path/from>:<path/to> ...",
+  std::cout << fmt::format("{} [options] <path/from>:<path/to> "
+                           "<path/from>:<path/to> ...",
                            program)
             << std::endl;
+  std::cout << "<path/from> may be a directory or @<file list> to copy many "
+               "files into directory <path/to> through one channel"
+            << std::endl;
+  std::cout << "options:" << std::endl;
+  std::cout << "  -s, --stage <spec>  add a stage transforming data in flight: "
+               "pass, fnv1a, xor[=<byte>]"
+            << std::endl;
+  std::cout << "  --static-batch      put a fixed number of cells in every "
+               "command instead of tuning it at runtime"
+            << std::endl;
+  std::cout << "  --mmap              map regular source files and pass "
+               "references to their data instead of copying it"
+            << std::endl;
+  std::cout << "  --threads           run pipelines in threads of this "
+               "process instead of forking"
+            << std::endl;
+  std::cout << fmt::format("  --cq <depth>        report completions back to "
+                           "the producer keeping up to depth (<= {}) "
+                           "commands in flight",
+                           cfq::kCqesLen)
+            << std::endl;
+  std::cout << "  --nt-stores <when>  fill cells with streaming stores: auto "
+               "(benchmarked at startup), always, never"
+            << std::endl;
+  std::cout << "  --trace <file>      record binary trace events of every "
+               "role to file, see ipc-cfq-trace"
+            << std::endl;
 }
 
-pcmds_t make_cmds(uint16_t cmds_len) {
-  auto p_cmds = cfq::map_shared<cfq::cmd>(sizeof(cfq::cmd) * cmds_len);
-  if (!p_cmds)
-    return {};
+/*
+ * All the structures of a pipeline's channel living in one shared mapping,
+ * p_cellc owns the mapping
+ */
+struct channel {
+  pcellcs_t p_cellc;
+  std::span<cfq::celld> cellds;
+  std::vector<qcmd_t *> qcmds;
+  qcqe_t *cq;
+};
+
+std::optional<channel> make_channel(size_t nqueues) {
+  auto p_map = cfq::map_shared<std::byte>(layout_t::size(nqueues));
+  if (!p_map)
+    return std::nullopt;
+
+  bool guarded = true;
+  layout_t::for_each_guard(nqueues, [&](size_t offset) {
+    if (mprotect(p_map.get() + offset, cfq::kPageSize, PROT_NONE) < 0)
+      guarded = false;
+  });
+  if (!guarded) {
+    spdlog::error("mprotect() failed, reason: {}", strerror(errno));
+    return std::nullopt;
+  }
 
-  auto *p_cmdsr = p_cmds.get();
-  std::memset(p_cmdsr, 0, sizeof(p_cmdsr[0]) * cmds_len);
+  /* The mapping is zero filled, only non-zero fields are to be set */
+  auto *p_cellcr = std::launder(reinterpret_cast<cfq::cellc *>(
+      p_map.get() + layout_t::cellc_region.offset));
+  p_cellcr->cell_sz = kCellSize;
+  p_cellcr->cells_len = kCellsNum;
 
-  return p_cmds;
-}
+  if (sem_init(&p_cellcr->cell_vacant, 1, p_cellcr->cells_len) < 0)
+    return std::nullopt;
 
-cfq::uptrwd<cfq::cb<uint32_t>> make_qcb() {
-  using cb = cfq::cb<uint32_t>;
-  return cfq::map_shared<cb>(sizeof(cb));
-}
+  auto map_d = std::move(p_map.get_deleter());
+  auto *p_mapr = p_map.release();
 
-pcelld_t make_cellds(uint16_t cells_len) {
-  auto p_cellds = cfq::map_shared<cfq::celld>(sizeof(cfq::celld) * cells_len);
-  if (!p_cellds)
-    return {};
+  channel chan;
 
-  std::memset(p_cellds.get(), 0, sizeof(cfq::celld) * cells_len);
+  try {
+    chan.p_cellc = pcellcs_t{
+        p_cellcr, [map_d, p_mapr, pid = getpid()](auto *p_cellcr) {
+          if (pid == getpid())
+            sem_destroy(&p_cellcr->cell_vacant);
+          map_d(p_mapr);
+        }};
+  } catch (...) {
+    sem_destroy(&p_cellcr->cell_vacant);
+    map_d(p_mapr);
+    throw;
+  }
 
-  return p_cellds;
-}
+  chan.cellds = {std::launder(reinterpret_cast<cfq::celld *>(
+                     p_mapr + layout_t::cellds_region.offset)),
+                 kCellsNum};
 
-pcellc_t make_cellc(uint16_t cell_sz, uint16_t cells_len) {
-  auto p_cellc =
-      cfq::map_shared<cfq::cellc>(sizeof(cfq::cellc) + cell_sz * cells_len);
-  if (!p_cellc)
-    return {};
+  chan.cq = cfq::make_static_cfq<cfq::cqe, cfq::kCqesLen>(
+      p_mapr + layout_t::cq_region.offset);
 
-  if (sem_init(&p_cellc->cell_vacant, 1, cells_len) < 0)
-    return {};
+  for (size_t nq = 0; nq < nqueues; ++nq) {
+    chan.qcmds.push_back(cfq::make_static_cfq<cfq::cmd, cfq::kCmdsLen>(
+        p_mapr + layout_t::queue(nq) + layout_t::queue_region.offset));
+  }
 
-  auto cellc_d = std::move(p_cellc.get_deleter());
-  auto *p_cellcr = p_cellc.release();
+  return chan;
+}
 
-  try {
-    p_cellc = pcellc_t(p_cellcr, [cellc_d, pid = getpid()](auto *p_cellcr) {
-      if (pid == getpid())
-        sem_destroy(&p_cellcr->cell_vacant);
-      cellc_d(p_cellcr);
-    });
-  } catch (...) {
-    sem_destroy(&p_cellcr->cell_vacant);
-    cellc_d(p_cellcr);
-    throw;
+/* Part of a pipeline run by its own process or thread */
+struct role {
+  std::string_view name;
+  std::function<int()> run;
+  cfq::trace::ring *ring = nullptr;
+};
+
+/* Writes the rings of all the roles attached to them to a trace file */
+bool dump_trace(std::filesystem::path const &path,
+                std::span<cfq::trace::ring const> rings) {
+  std::vector<cfq::trace::ring const *> attached;
+  for (auto const &ring : rings) {
+    if (cfq::trace::kRingMagic == ring.magic)
+      attached.push_back(&ring);
   }
 
-  p_cellc->cell_sz = cell_sz;
-  p_cellc->cells_len = cells_len;
-  std::memset(p_cellc->cells, 0, p_cellc->cell_sz * p_cellc->cells_len);
+  cfq::trace::file_header const hdr{
+      .magic = cfq::trace::kFileMagic,
+      .nrings = static_cast<uint32_t>(attached.size()),
+      .reserved = 0,
+      .ticks_per_us = cfq::trace::calibrate(),
+  };
 
-  return p_cellc;
+  std::ofstream f{path, std::ios::out | std::ios::binary | std::ios::trunc};
+  f.write(reinterpret_cast<char const *>(&hdr), sizeof(hdr));
+  for (auto const *ring : attached)
+    f.write(reinterpret_cast<char const *>(ring), sizeof(*ring));
+
+  return !!f;
+}
+
+/*
+ * Collects files to multiplex through one channel if path given is a
+ * directory or a @<file list> with one path per line
+ */
+std::optional<std::vector<cfq::file_pair>>
+collect_files(std::filesystem::path const &from) {
+  std::vector<cfq::file_pair> files;
+
+  if (auto const &from_str = from.native(); from_str.starts_with('@')) {
+    std::ifstream list{from_str.substr(1)};
+    if (!list)
+      throw std::invalid_argument(
+          fmt::format("failed to open file list '{}'", from_str.substr(1)));
+    for (std::string line; std::getline(list, line);) {
+      if (line.empty())
+        continue;
+      std::filesystem::path path{line};
+      auto rel = path.relative_path().lexically_normal();
+      /* The consumer would refuse to write it outside of its root */
+      if (rel.empty() || rel == "." || *rel.begin() == "..") {
+        throw std::invalid_argument(fmt::format(
+            "path '{}' of file list '{}' does not name a file under the "
+            "destination",
+            line, from_str.substr(1)));
+      }
+      files.push_back({std::move(path), std::move(rel)});
+    }
+  } else if (std::filesystem::is_directory(from)) {
+    for (auto const &entry :
+         std::filesystem::recursive_directory_iterator{from}) {
+      if (entry.is_regular_file())
+        files.push_back(
+            {entry.path(), entry.path().lexically_relative(from)});
+    }
+  } else {
+    return std::nullopt;
+  }
+
+  return files;
 }
 
 } // namespace
 
-/* Run example: ./cfq <path/from>:<path/to> <path/from>:<path/to> ... */
+/*
+ * Run example:
+ * ./cfq [options] <path/from>:<path/to> <path/from>:<path/to> ...
+ */
 int main(int argc, char const *argv[]) {
   int r = EXIT_SUCCESS;
 
@@ -132,11 +262,78 @@ int main(int argc, char const *argv[]) {
     kRolesQty,
   };
 
+  std::vector<std::string> stage_specs;
+  bool adaptive = true;
+  bool mmap = false;
+  bool threaded = false;
+  std::filesystem::path trace_path;
+  uint16_t cq_depth = 0;
+  /* Benchmarked unless given */
+  std::optional<size_t> nt_threshold;
+  std::vector<char const *> pair_args;
   std::vector<std::array<std::filesystem::path, kRolesQty>> path_pairs;
+  std::vector<std::optional<std::vector<cfq::file_pair>>> trees;
   try {
+    for (int i = 1; i < argc; ++i) {
+      if (std::string_view const arg{argv[i]};
+          arg == "-s" || arg == "--stage") {
+        if (++i == argc)
+          throw std::invalid_argument(
+              fmt::format("option '{}' requires a stage spec", arg));
+        /* Validate the spec early, stages build their own transforms */
+        cfq::make_transform(argv[i]);
+        stage_specs.emplace_back(argv[i]);
+      } else if (arg == "--static-batch") {
+        adaptive = false;
+      } else if (arg == "--mmap") {
+        mmap = true;
+      } else if (arg == "--threads") {
+        threaded = true;
+      } else if (arg == "--cq") {
+        if (++i == argc)
+          throw std::invalid_argument(
+              fmt::format("option '{}' requires a depth", arg));
+        try {
+          cq_depth = boost::lexical_cast<uint16_t>(argv[i]);
+        } catch (boost::bad_lexical_cast const &) {
+          cq_depth = 0;
+        }
+        if (0 == cq_depth || cq_depth > cfq::kCqesLen) {
+          throw std::invalid_argument(
+              fmt::format("depth must be in range [1, {}]", cfq::kCqesLen));
+        }
+      } else if (arg == "--nt-stores") {
+        if (++i == argc)
+          throw std::invalid_argument(
+              fmt::format("option '{}' requires a value", arg));
+        if (std::string_view const when{argv[i]}; when == "always")
+          nt_threshold = 0;
+        else if (when == "never")
+          nt_threshold = std::numeric_limits<size_t>::max();
+        else if (when != "auto")
+          throw std::invalid_argument(
+              fmt::format("invalid value '{}' of option '{}'", when, arg));
+      } else if (arg == "--trace") {
+        if (!CFQ_TRACE)
+          throw std::invalid_argument("tracing is disabled at compile time");
+        if (++i == argc)
+          throw std::invalid_argument(
+              fmt::format("option '{}' requires a file path", arg));
+        trace_path = argv[i];
+      } else {
+        pair_args.push_back(argv[i]);
+      }
+    }
+
+    if (pair_args.empty())
+      throw std::invalid_argument("no <path/from>:<path/to> given");
+
+    /* Stages transform cells in place, referenced data is read-only */
+    if (mmap && !stage_specs.empty())
+      throw std::invalid_argument("--mmap cannot be combined with stages");
+
     std::ranges::transform(
-        std::span{argv + 1, static_cast<size_t>(argc) - 1},
-        std::back_inserter(path_pairs), [](auto const *arg) {
+        pair_args, std::back_inserter(path_pairs), [](auto const *arg) {
           std::vector<std::filesystem::path> paths;
           boost::split(paths, arg, boost::is_any_of(":"),
                        boost::token_compress_on);
@@ -149,6 +346,11 @@ int main(int argc, char const *argv[]) {
           return std::array{std::move(paths[kRoleReader]),
                             std::move(paths[kRoleWriter])};
         });
+
+    std::ranges::transform(path_pairs, std::back_inserter(trees),
+                           [](auto const &path_pair) {
+                             return collect_files(path_pair[kRoleReader]);
+                           });
   } catch (std::exception const &ex) {
     spdlog::critical(ex.what());
     show_help(argv[0]);
@@ -156,64 +358,154 @@ int main(int argc, char const *argv[]) {
   }
 
   std::vector<std::pair<pid_t, std::shared_ptr<cfq::cellc>>> children;
+  std::vector<std::future<int>> tasks;
+
+  if (threaded)
+    spdlog::set_pattern("[thread %t] [%^%l%$]: %v");
 
   /*
-   * Create up to path_pairs.size() children by forking
+   * Only regular files which are not referenced with --mmap are copied into
+   * the cells by the kernels, the benchmark is not worth running otherwise
    */
-  for (auto const &path_pair : path_pairs) {
-    auto p_cmds = make_cmds(kCmdsMax + 1);
-    if (!p_cmds) {
-      r = EXIT_FAILURE;
-      break;
+  auto const fills_cells = [&] {
+    auto const regular = [](std::filesystem::path const &p) {
+      std::error_code ec;
+      return std::filesystem::is_regular_file(p, ec);
+    };
+    for (size_t npair = 0; npair < path_pairs.size(); ++npair) {
+      if (auto const &tree = trees[npair]) {
+        if (std::ranges::any_of(*tree, [&](auto const &file) {
+              return regular(file[kRoleReader]);
+            }))
+          return true;
+      } else if (!mmap && regular(path_pairs[npair][kRoleReader])) {
+        return true;
+      }
     }
+    return false;
+  };
 
-    auto p_qcb = make_qcb();
-    if (!p_qcb) {
-      r = EXIT_FAILURE;
-      break;
-    }
+  auto const &copy_kernel = cfq::best_copy_kernel();
+  if (!nt_threshold) {
+    nt_threshold = fills_cells() ? cfq::copy_crossover(copy_kernel, kCellSize,
+                                                       kCellsNum)
+                                 : std::numeric_limits<size_t>::max();
+  }
+  spdlog::info("copy: {} kernel, streaming stores {}",
+               to_string(copy_kernel.isa),
+               std::numeric_limits<size_t>::max() == *nt_threshold
+                   ? "off"
+                   : fmt::format("from {} bytes", *nt_threshold));
+
+  auto const roles_per_pair = stage_specs.size() + 2;
+
+  cfq::mem_t<cfq::trace::ring> p_rings;
+  std::span<cfq::trace::ring> rings;
+  if (!trace_path.empty()) {
+    auto const nrings = roles_per_pair * path_pairs.size();
+    p_rings =
+        cfq::map_shared<cfq::trace::ring>(sizeof(cfq::trace::ring) * nrings);
+    if (!p_rings)
+      return EXIT_FAILURE;
+    rings = {p_rings.get(), nrings};
+  }
 
-    auto p_qcmd = cfq::make_qcmd(
-        cfq::make_cfqcb(std::shared_ptr<cfq::cb<uint32_t>>{std::move(p_qcb)}),
-        std::span{p_cmds.get(), kCmdsMax + 1});
-    if (!p_qcmd) {
-      r = EXIT_FAILURE;
-      break;
-    }
+  /*
+   * Create up to path_pairs.size() pipelines by forking or spawning threads,
+   * each pipeline is made of a producer, stage_specs.size() stages and a
+   * consumer chained with command queues and sharing the same cells
+   */
+  for (size_t npair = 0; npair < path_pairs.size(); ++npair) {
+    auto const &path_pair = path_pairs[npair];
+    auto const *tree = trees[npair] ? &*trees[npair] : nullptr;
 
-    auto p_cellc = pcellcs_t{make_cellc(kCellSize, kCellsNum)};
-    if (!p_cellc) {
+    auto chan = make_channel(stage_specs.size() + 1);
+    if (!chan) {
       r = EXIT_FAILURE;
       break;
     }
 
-    auto p_cellds = make_cellds(p_cellc->cells_len);
-    if (!p_cellds) {
-      r = EXIT_FAILURE;
-      break;
-    }
+    auto const &p_cellc = chan->p_cellc;
+    auto const &qcmds = chan->qcmds;
+    auto const cellds = chan->cellds;
 
     cfq::producer_cfq const pr_cfg{
-        static_cast<uint16_t>(p_cellc->cells_len * p_cellc->cell_sz)};
-
-    std::array<std::function<int()>, kRolesQty> child_handlers{
-        [&] {
-          return producer(*p_qcmd, {p_cellds.get(), p_cellc->cells_len},
-                          *p_cellc, path_pair[kRoleReader], pr_cfg);
-        },
-        [&] {
-          return consumer(*p_qcmd, {p_cellds.get(), p_cellc->cells_len},
-                          *p_cellc, path_pair[kRoleWriter]);
-        },
+        .bsize = static_cast<uint16_t>(p_cellc->cells_len * p_cellc->cell_sz),
+        .adaptive = adaptive,
+        .mmap = mmap,
+        .cq_depth = cq_depth,
+        /* Resubmitted data would be transformed by stages once again */
+        .retries = static_cast<uint8_t>(stage_specs.empty() ? kRetries : 0),
+        .nt_threshold = *nt_threshold,
     };
 
-    for (uint32_t role_id = 0; role_id < kRolesQty; ++role_id) {
+    auto *const cq = cq_depth ? chan->cq : nullptr;
+
+    /*
+     * Roles hold everything they need by value but what outlives them
+     * anyway, so that they can run in threads after this iteration is over
+     */
+    std::vector<role> roles;
+    roles.reserve(roles_per_pair);
+
+    roles.push_back({"producer", [=, p_qcmd = qcmds.front()] {
+                       if (tree)
+                         return producer(*p_qcmd, cellds, *p_cellc,
+                                         std::span{*tree}, pr_cfg, cq);
+                       return producer(*p_qcmd, cellds, *p_cellc,
+                                       path_pair[kRoleReader], pr_cfg, cq);
+                     }});
+    for (size_t i = 0; i < stage_specs.size(); ++i) {
+      roles.push_back(
+          {"stage", [=, &spec = stage_specs[i], p_qin = qcmds[i],
+                     p_qout = qcmds[i + 1]] {
+             auto const tr = cfq::make_transform(spec);
+             return stage(*p_qin, *p_qout, cellds, *p_cellc, *tr);
+           }});
+    }
+    roles.push_back({"consumer", [=, p_qcmd = qcmds.back()] {
+                       if (tree)
+                         return consumer_tree(*p_qcmd, cellds, *p_cellc,
+                                              path_pair[kRoleWriter], cq);
+                       return consumer(*p_qcmd, cellds, *p_cellc,
+                                       path_pair[kRoleWriter],
+                                       path_pair[kRoleReader], cq);
+                     }});
+
+    if (!rings.empty()) {
+      for (size_t nrole = 0; nrole < roles.size(); ++nrole)
+        roles[nrole].ring = &rings[npair * roles_per_pair + nrole];
+    }
+
+    if (threaded) {
+      for (auto &role : roles) {
+        try {
+          tasks.push_back(std::async(
+              std::launch::async, [name = role.name, ring = role.ring,
+                                   run = std::move(role.run)] {
+                cfq::trace::attach(ring, name);
+                return run();
+              }));
+        } catch (std::exception const &ex) {
+          /* Roles already running would never finish, nothing to join */
+          spdlog::critical("failed to create thread, reason: {}", ex.what());
+          std::quick_exit(EXIT_FAILURE);
+        }
+      }
+      continue;
+    }
+
+    auto const children_before = children.size();
+
+    for (auto &role : roles) {
       if (auto const child_pid = fork(); 0 == child_pid) {
         children.clear();
         children.shrink_to_fit();
-        auto handler = std::move(child_handlers[role_id]);
-        child_handlers = {};
-        return handler ? handler() : EXIT_FAILURE;
+        auto run = std::move(role.run);
+        spdlog::set_pattern(fmt::format("[{} %P] [%^%l%$]: %v", role.name));
+        cfq::trace::attach(role.ring, role.name);
+        roles.clear();
+        return run ? run() : EXIT_FAILURE;
       } else if (child_pid > 0) {
         /* We're in a parent's body, remember a new child's PID */
         children.push_back({child_pid, p_cellc});
@@ -224,10 +516,24 @@ int main(int argc, char const *argv[]) {
       }
     }
 
-    if (0 != (children.size() % 2)) {
-      if (kill(std::get<0>(children.back()), SIGTERM) < 0)
-        kill(std::get<0>(children.back()), SIGKILL);
-      children.pop_back();
+    /* An incomplete pipeline would never finish, tear it down */
+    if (children.size() - children_before != roles.size()) {
+      while (children.size() > children_before) {
+        if (kill(std::get<0>(children.back()), SIGTERM) < 0)
+          kill(std::get<0>(children.back()), SIGKILL);
+        children.pop_back();
+      }
+    }
+  }
+
+  /* Wait for all the threads to finish */
+  for (auto &task : tasks) {
+    try {
+      if (EXIT_SUCCESS != task.get())
+        r = EXIT_FAILURE;
+    } catch (std::exception const &ex) {
+      spdlog::error("thread failed, reason: {}", ex.what());
+      r = EXIT_FAILURE;
     }
   }
 
@@ -235,12 +541,20 @@ int main(int argc, char const *argv[]) {
   while (!children.empty()) {
     int wstatus{0};
     auto const child = waitpid(-1, &wstatus, 0);
-    if (WIFEXITED(wstatus))
+    if (WIFEXITED(wstatus)) {
       spdlog::info("child {} exited", child);
+      if (EXIT_SUCCESS != WEXITSTATUS(wstatus))
+        r = EXIT_FAILURE;
+    }
     std::erase_if(children, [child](auto const &desc) {
       return std::get<0>(desc) == child;
     });
   }
 
+  if (!rings.empty() && !dump_trace(trace_path, rings)) {
+    spdlog::error("failed to write trace to {}", trace_path.string());
+    r = EXIT_FAILURE;
+  }
+
   return r;
 }
@@ -1,26 +1,41 @@
 #include "producer.hpp"
 
+#include <cerrno>
 #include <climits>
 #include <cstddef>
 #include <cstdlib>
+#include <cstring>
 
 #include <semaphore.h>
 #include <type_traits>
 #include <unistd.h>
 
+#include <algorithm>
+#include <array>
+#include <chrono>
 #include <concepts>
 #include <fstream>
 #include <ios>
+#include <istream>
 #include <limits>
+#include <optional>
+#include <string>
+#include <string_view>
 #include <thread>
+#include <vector>
 
 #include <spdlog/spdlog.h>
 
 #include "cmd.hpp"
+#include "copy.hpp"
+#include "fref.hpp"
+#include "trace.hpp"
+#include "tuner.hpp"
 
 namespace {
 
-cfq::cmd make_cmd(uint16_t id, uint8_t op, uint16_t fcd, uint16_t cnum) {
+cfq::cmd make_cmd(uint16_t id, uint8_t op, uint16_t fcd, uint16_t cnum,
+                  uint16_t fid = 0) {
   cfq::cmd cmd;
 
   cmd.set_id(id);
@@ -28,6 +43,9 @@ cfq::cmd make_cmd(uint16_t id, uint8_t op, uint16_t fcd, uint16_t cnum) {
   cmd.set_fl(0);
   cmd.set_fcdn(fcd);
   cmd.set_cnum(cnum);
+  cmd.set_fid(fid);
+  cmd.reserved1 = 0;
+  cmd.reserved2 = 0;
 
   return cmd;
 }
@@ -36,82 +54,486 @@ template <std::integral T> constexpr T div_round_up(T v, T d) noexcept {
   return (v + d - 1) / d;
 }
 
-} // namespace
+/*
+ * Data read from a regular file at once before it is copied into the cells,
+ * other sources are read a cell at a time not to hold data back
+ */
+constexpr size_t kStagingSize = 64 * 1024;
+
+/*
+ * Turns data into commands over the cells, keeps the state that has to
+ * survive across files multiplexed through the same channel
+ */
+class feeder {
+public:
+  explicit feeder(cfq::qcmd_t<cfq::cmd, cfq::kCmdsLen> &qcmd,
+                  std::span<cfq::celld> cellds, cfq::cellc &cellc,
+                  cfq::producer_cfq const &cfg,
+                  cfq::qcqe_t<cfq::cqe, cfq::kCqesLen> *cq) noexcept
+      : qcmd_(qcmd), cellds_(cellds), cellc_(cellc),
+        max_cells_at_once_(
+            std::min(div_round_up(cfg.bsize, cellc.cell_sz), cellc.cells_len)),
+        copy_(cfg.nt_threshold),
+        staging_(std::max<size_t>(kStagingSize / cellc.cell_sz, 1) *
+                 cellc.cell_sz),
+        cq_(cq), depth_(std::clamp<size_t>(cfg.cq_depth, 1, cfq::kCqesLen)),
+        retries_left_(cfg.retries) {
+    if (cfg.adaptive)
+      tuner_.emplace(1, max_cells_at_once_);
+  }
 
-namespace cfq {
+  /* Whether a failure reported through the completion queue stopped us */
+  [[nodiscard]] bool aborted() const noexcept { return aborted_; }
 
-int producer(qcmd_t<cmd, uint32_t, uint32_t> &qcmd, std::span<celld> cellds,
-             cellc &cellc, std::filesystem::path const &p,
-             producer_cfq const &cfg) {
-  spdlog::set_pattern("[producer %P] [%^%l%$]: %v");
+  [[nodiscard]] cfq::batch_tuner const *tuner() const noexcept {
+    return tuner_ ? &*tuner_ : nullptr;
+  }
 
-  spdlog::info("started: file to read {}", p.string());
+  /*
+   * Data staged by one read, in proportion to the batch so that reads get
+   * shorter as the consumer backs up, a whole staging buffer at most
+   */
+  [[nodiscard]] size_t read_size() const noexcept {
+    if (!tuner_)
+      return staging_.size();
+
+    auto const cells = staging_.size() / cellc_.cell_sz;
+    return std::max<size_t>(cells * tuner_->batch() / max_cells_at_once_, 1) *
+           cellc_.cell_sz;
+  }
+
+  void stream(std::istream &f, bool staged, uint16_t fid = 0) {
+    while (more(f) && !aborted_) {
+      uint16_t const max_cells =
+          tuner_ ? tuner_->update(sample()) : max_cells_at_once_;
+
+      uint16_t cells_len = 0;
+
+      cfq::celld dummy_celld{};
+      for (cfq::celld *prev_celld = &dummy_celld;
+           more(f) && cells_len < max_cells;) {
+
+        if (sem_trywait(&cellc_.cell_vacant) < 0) [[unlikely]]
+          break;
+
+        uint16_t const data_sz =
+            staged ? fill(f, cell(ncell_), cellc_.cell_sz)
+                   : read(f, cell(ncell_), cellc_.cell_sz);
+        if (data_sz) [[likely]] {
+          link(prev_celld, data_sz);
+          ++cells_len;
+        } else {
+          sem_post(&cellc_.cell_vacant);
+        }
+      }
+
+      if (cells_len > 0) [[likely]]
+        push(op_write(dummy_celld.ncell, cells_len, fid));
+      else
+        idle();
+    }
+  }
+
+  /*
+   * Sends the whole source as op_wref commands with a reference to a chunk of
+   * the file per cell, the consumer writes straight from its own mapping
+   */
+  void reference(cfq::fref_map &src, uint16_t fid = 0) {
+    for (uint64_t offset = 0; offset < src.size() && !aborted_;) {
+      uint16_t const max_cells =
+          tuner_ ? tuner_->update(sample()) : max_cells_at_once_;
+
+      uint16_t cells_len = 0;
+
+      cfq::celld dummy_celld{};
+      for (cfq::celld *prev_celld = &dummy_celld;
+           offset < src.size() && cells_len < max_cells;) {
 
-  uint16_t const max_cells_at_once =
-      std::min(div_round_up(cfg.bsize, cellc.cell_sz), cellc.cells_len);
+        if (sem_trywait(&cellc_.cell_vacant) < 0) [[unlikely]]
+          break;
 
-  uint32_t cmd_id = 0;
-  uint16_t ncell = 0;
+        auto const ref = src.at(offset);
 
-  for (std::ifstream f{p, std::ios::in | std::ios::binary}; f;) {
-    spdlog::debug("is working");
+        /* Map the window ahead of the consumer to get it read in */
+        src.get(ref);
+
+        std::memcpy(cell(ncell_), &ref, sizeof(ref));
+        link(prev_celld, sizeof(ref));
+        ++cells_len;
+
+        offset += ref.len;
+      }
+
+      if (cells_len > 0) [[likely]]
+        push(make_cmd(cmd_id_++, cfq::op_wref, dummy_celld.ncell, cells_len,
+                      fid));
+      else
+        idle();
+    }
+  }
+
+  /*
+   * Sends op_open binding fid to path, the path is carried by the cells and
+   * must fit in all the cells at once, fails as well if we have aborted
+   */
+  bool open(uint16_t fid, std::string_view path) {
+    if (path.empty() || path.size() > cellc_.cell_sz * cellc_.cells_len)
+      return false;
 
     uint16_t cells_len = 0;
 
-    celld dummy_celld{};
-    for (celld *prev_celld = &dummy_celld;
-         f && cells_len < max_cells_at_once;) {
+    cfq::celld dummy_celld{};
+    for (cfq::celld *prev_celld = &dummy_celld; !path.empty();) {
+      if (!take_cell()) [[unlikely]] {
+        for (; cells_len > 0; --cells_len)
+          sem_post(&cellc_.cell_vacant);
+        return false;
+      }
+
+      auto const data_sz =
+          static_cast<uint16_t>(std::min<size_t>(path.size(), cellc_.cell_sz));
+      std::memcpy(cell(ncell_), path.data(), data_sz);
+      path.remove_prefix(data_sz);
 
-      if (sem_trywait(&cellc.cell_vacant) < 0) [[unlikely]]
-        break;
+      link(prev_celld, data_sz);
+      ++cells_len;
+    }
+
+    push(make_cmd(cmd_id_++, cfq::op_open, dummy_celld.ncell, cells_len, fid));
+    return true;
+  }
 
-      uint16_t data_sz{cellc.cell_sz};
-      if (!f.read(reinterpret_cast<char *>(cellc.cells + cellc.cell_sz * ncell),
-                  data_sz)) [[unlikely]] {
+  void close(uint16_t fid) {
+    push(make_cmd(cmd_id_++, cfq::op_close, 0, 0, fid));
+  }
+
+  /* Waits for all the commands to complete, if they are, and ends the data */
+  void eof() {
+    while (cq_ && inflight_len_ > 0 && !aborted_)
+      idle();
+
+    enqueue(make_cmd(cmd_id_, cfq::op_eof, 0, 0));
+  }
+
+private:
+  cfq::tuner_sample sample() const noexcept {
+    int vacant{0};
+    sem_getvalue(&cellc_.cell_vacant, &vacant);
+    vacant = std::clamp<int>(vacant, 0, cellc_.cells_len);
+
+    return {
+        .queued = qcmd_.size(),
+        .queue_capacity = qcmd_.capacity(),
+        .cells_vacant = static_cast<uint32_t>(vacant),
+        .cells_len = cellc_.cells_len,
+        .cells_taken = cells_taken_,
+        .cells_released = cells_taken_ - (cellc_.cells_len - vacant),
+    };
+  }
+
+  bool more(std::istream const &f) const noexcept {
+    return staged_ < staging_end_ || f;
+  }
 
-        data_sz = f.gcount();
+  /*
+   * Copies up to n bytes of f into dst through the staging buffer, reads are
+   * multiples of the cell size so that a cell is filled by one copy
+   */
+  uint16_t fill(std::istream &f, std::byte *dst, uint16_t n) {
+    uint16_t done = 0;
+    while (done < n) {
+      if (staged_ == staging_end_) {
+        if (!f)
+          break;
+        f.read(reinterpret_cast<char *>(staging_.data()), read_size());
+        staged_ = 0;
+        staging_end_ = f.gcount();
+        if (0 == staging_end_) [[unlikely]]
+          break;
       }
 
-      if (data_sz) [[likely]] {
-        auto *p_celld = &cellds[ncell];
-        p_celld->data_sz = data_sz;
-        p_celld->ncell = cellc.cells_len;
+      auto const len = std::min<size_t>(n - done, staging_end_ - staged_);
+      copy_(dst + done, staging_.data() + staged_, len);
+      staged_ += len;
+      done += len;
+    }
+    return done;
+  }
 
-        prev_celld->ncell = ncell;
-        prev_celld = p_celld;
+  /* Reads up to n bytes of f straight into dst */
+  static uint16_t read(std::istream &f, std::byte *dst, uint16_t n) {
+    f.read(reinterpret_cast<char *>(dst), n);
+    return f.gcount();
+  }
 
-        ncell = (ncell + 1) % cellds.size();
-        ++cells_len;
-      } else {
-        sem_post(&cellc.cell_vacant);
+  std::byte *cell(uint16_t ncell) const noexcept {
+    return cellc_.cells + cellc_.cell_sz * ncell;
+  }
+
+  /* Appends the current cell to the chain and moves on to the next one */
+  void link(cfq::celld *&prev_celld, uint16_t data_sz) noexcept {
+    auto *p_celld = &cellds_[ncell_];
+    p_celld->data_sz = data_sz;
+    p_celld->ncell = cellc_.cells_len;
+
+    prev_celld->ncell = ncell_;
+    prev_celld = p_celld;
+
+    ncell_ = (ncell_ + 1) % cellds_.size();
+    ++cells_taken_;
+  }
+
+  cfq::cmd op_write(uint16_t fcdn, uint16_t cells_len, uint16_t fid) noexcept {
+    return make_cmd(cmd_id_++, cfq::op_write, fcdn, cells_len, fid);
+  }
+
+  /* Blocks until a cell is vacant, returns false if we abort meanwhile */
+  bool take_cell() {
+    if (!cq_) {
+      while (sem_wait(&cellc_.cell_vacant) < 0)
+        ;
+      return true;
+    }
+
+    /*
+     * Cells are only released by us once their commands complete, those of
+     * the commands failed are never released once we abort
+     */
+    while (sem_trywait(&cellc_.cell_vacant) < 0) {
+      if (aborted_)
+        return false;
+      idle();
+    }
+    return true;
+  }
+
+  void idle() {
+    if (!cq_ || !reap())
+      std::this_thread::yield();
+  }
+
+  /*
+   * Keeps commands in flight up to the depth given and none while failing,
+   * commands are remembered until they complete
+   */
+  void push(cfq::cmd const &v) {
+    if (cq_) {
+      while ((inflight_len_ >= depth_ || failing_) && !aborted_)
+        idle();
+      if (aborted_) [[unlikely]]
+        return;
+
+      inflight_[(inflight_head_ + inflight_len_) % inflight_.size()] = v;
+      ++inflight_len_;
+    }
+
+    enqueue(v);
+  }
+
+  /* Handles completions arrived, returns whether there were any */
+  bool reap() {
+    bool reaped = false;
+
+    while (auto const c = cq_->pop()) {
+      reaped = true;
+
+      auto const &v = inflight_[(inflight_head_ + ncompleted_) %
+                                inflight_.size()];
+      CFQ_TRACE_EVENT(cfq::trace::ev_cqe, v, c->status);
+
+      if (c->id != v.get_id()) [[unlikely]] {
+        spdlog::error("completion of cmd {} is out of order, expected {}",
+                      c->id, v);
+      }
+
+      if (!failing_ && 0 == c->status) [[likely]] {
+        release(v);
+        inflight_head_ = (inflight_head_ + 1) % inflight_.size();
+        --inflight_len_;
+        continue;
       }
+
+      if (!failing_) {
+        spdlog::warn("{} failed, reason: {}", v, strerror(c->status));
+        failing_ = true;
+        status_ = c->status;
+      }
+
+      if (++ncompleted_ == inflight_len_)
+        settle();
     }
 
-    if (cells_len > 0) [[likely]] {
-      auto const v = make_cmd(cmd_id, op_write, dummy_celld.ncell, cells_len);
-      while (!qcmd.push(v))
-        std::this_thread::yield();
+    return reaped;
+  }
 
-      spdlog::debug("pushed {}", v);
+  /*
+   * All the commands following a failed one have been cancelled, resubmit
+   * them all in order unless the failure is there to stay
+   */
+  void settle() {
+    if (retries_left_ > 0 && retriable(status_)) {
+      --retries_left_;
+
+      spdlog::warn("resubmitting {} commands", inflight_len_);
+      std::this_thread::sleep_for(std::chrono::milliseconds{10});
+
+      for (size_t i = 0; i < inflight_len_; ++i) {
+        auto v = inflight_[(inflight_head_ + i) % inflight_.size()];
+        if (0 == i)
+          v.set_fl(v.get_fl() | cfq::fl_retry);
+        enqueue(v);
+      }
 
-      ++cmd_id;
+      failing_ = false;
+      ncompleted_ = 0;
     } else {
-      std::this_thread::yield();
+      spdlog::error("aborting, reason: {}", strerror(status_));
+      aborted_ = true;
     }
   }
 
-  auto const v = make_cmd(cmd_id, op_eof, 0, 0);
+  static bool retriable(int status) noexcept {
+    return EAGAIN == status || EINTR == status || ENOSPC == status ||
+           EDQUOT == status;
+  }
+
+  void release(cfq::cmd const &v) noexcept {
+    for (auto n = v.get_cnum(); n > 0; --n)
+      sem_post(&cellc_.cell_vacant);
+  }
+
+  void enqueue(cfq::cmd const &v) {
+    if (!qcmd_.push(v)) [[unlikely]] {
+      CFQ_TRACE_EVENT(cfq::trace::ev_full, v);
+      while (!qcmd_.push(v))
+        std::this_thread::yield();
+    }
+
+    CFQ_TRACE_EVENT(cfq::trace::ev_push, v);
+  }
+
+  cfq::qcmd_t<cfq::cmd, cfq::kCmdsLen> &qcmd_;
+  std::span<cfq::celld> cellds_;
+  cfq::cellc &cellc_;
+  uint16_t const max_cells_at_once_;
+  std::optional<cfq::batch_tuner> tuner_;
+
+  uint32_t cmd_id_ = 0;
+  uint16_t ncell_ = 0;
+  uint64_t cells_taken_ = 0;
+
+  cfq::cell_copier const copy_;
+  std::vector<std::byte> staging_;
+  size_t staged_ = 0;
+  size_t staging_end_ = 0;
+
+  cfq::qcqe_t<cfq::cqe, cfq::kCqesLen> *cq_;
+  size_t const depth_;
+  uint8_t retries_left_;
+  std::array<cfq::cmd, cfq::kCqesLen> inflight_;
+  size_t inflight_head_ = 0;
+  size_t inflight_len_ = 0;
+  size_t ncompleted_ = 0;
+  bool failing_ = false;
+  bool aborted_ = false;
+  int status_ = 0;
+};
+
+void log_tuner(feeder const &fdr) {
+  if (auto const *tuner = fdr.tuner()) {
+    auto const &st = tuner->get_stats();
+    spdlog::info("tuner: batch {}, read {}, grows {}, shrinks {}, holds {}, "
+                 "last {}, fill {:.0f}/s, drain {:.0f}/s",
+                 st.batch, fdr.read_size(), st.grows, st.shrinks, st.holds,
+                 to_string(st.last), st.fill_rate, st.drain_rate);
+  }
+}
+
+} // namespace
+
+namespace cfq {
+
+int producer(qcmd_t<cmd, kCmdsLen> &qcmd, std::span<celld> cellds,
+             cellc &cellc, std::filesystem::path const &p,
+             producer_cfq const &cfg, qcqe_t<cqe, kCqesLen> *cq) {
+  spdlog::info("started: file to read {}", p.string());
+
+  feeder fdr{qcmd, cellds, cellc, cfg, cq};
+
+  int r = EXIT_SUCCESS;
+
+  if (cfg.mmap && cellc.cell_sz >= sizeof(fref) &&
+      std::filesystem::is_regular_file(p)) {
+    try {
+      fref_map src{p};
+      fdr.reference(src);
+    } catch (std::exception const &ex) {
+      spdlog::error("failed to reference {}, reason: {}", p.string(),
+                    ex.what());
+      r = EXIT_FAILURE;
+    }
+  } else {
+    std::ifstream f{p, std::ios::in | std::ios::binary};
+    fdr.stream(f, std::filesystem::is_regular_file(p));
+  }
+
+  fdr.eof();
+
+  log_tuner(fdr);
+
+  if (fdr.aborted())
+    r = EXIT_FAILURE;
+
+  spdlog::info("finished");
+
+  return r;
+}
+
+int producer(qcmd_t<cmd, kCmdsLen> &qcmd, std::span<celld> cellds,
+             cellc &cellc, std::span<file_pair const> files,
+             producer_cfq const &cfg, qcqe_t<cqe, kCqesLen> *cq) {
+  spdlog::info("started: files to read {}", files.size());
+
+  int r = EXIT_SUCCESS;
+
+  feeder fdr{qcmd, cellds, cellc, cfg, cq};
+
+  uint16_t fid = 0;
+  for (auto const &[from, to] : files) {
+    if (fdr.aborted())
+      break;
+
+    std::ifstream f{from, std::ios::in | std::ios::binary};
+    if (!f) {
+      spdlog::error("failed to open {}", from.string());
+      r = EXIT_FAILURE;
+      continue;
+    }
+
+    if (!fdr.open(fid, to.generic_string())) {
+      if (fdr.aborted())
+        break;
+      spdlog::error("path {} is too long", to.string());
+      r = EXIT_FAILURE;
+      continue;
+    }
+
+    fdr.stream(f, std::filesystem::is_regular_file(from), fid);
+    fdr.close(fid);
+
+    ++fid;
+  }
 
-  spdlog::debug("is pushing last cmd {} ...", v);
+  fdr.eof();
 
-  while (!qcmd.push(v))
-    std::this_thread::yield();
+  log_tuner(fdr);
 
-  spdlog::debug("pushed last cmd {} ...", v);
+  if (fdr.aborted())
+    r = EXIT_FAILURE;
 
   spdlog::info("finished");
 
-  return EXIT_SUCCESS;
+  return r;
 }
 
 } // namespace cfq
@@ -2,22 +2,49 @@
 
 #include <cstdint>
 
+#include <array>
 #include <filesystem>
 #include <span>
 
 #include "cellc.hpp"
 #include "celld.hpp"
 #include "cmd.hpp"
+#include "cqe.hpp"
 #include "qcmd.hpp"
 
 namespace cfq {
 
 struct producer_cfq {
+  /* Upper bound of data put in one command */
   uint16_t bsize;
+  /* Whether to tune the number of cells per command at runtime */
+  bool adaptive;
+  /*
+   * Whether to send references to a mapped regular file instead of copying
+   * its data into the cells
+   */
+  bool mmap;
+  /* Commands kept in flight at most if there is a completion queue */
+  uint16_t cq_depth;
+  /* Times to resubmit commands failed for a transient reason */
+  uint8_t retries;
+  /* Cells are filled by streaming stores from this size of data on */
+  size_t nt_threshold;
 };
 
-int producer(qcmd_t<cmd, uint32_t, uint32_t> &qcmd, std::span<celld> cellds,
+/* Source file and the path relative to consumer's root to write it to */
+using file_pair = std::array<std::filesystem::path, 2>;
+
+/*
+ * If cq is given cells are released as the commands complete through it,
+ * failed commands get resubmitted or make the producer abort
+ */
+int producer(qcmd_t<cmd, kCmdsLen> &qcmd, std::span<celld> cellds,
              cellc &cellc, std::filesystem::path const &p,
-             producer_cfq const &cfg);
+             producer_cfq const &cfg, qcqe_t<cqe, kCqesLen> *cq);
+
+int producer(qcmd_t<cmd, kCmdsLen> &qcmd, std::span<celld> cellds,
+             cellc &cellc, std::span<file_pair const> files,
+             producer_cfq const &cfg, qcqe_t<cqe, kCqesLen> *cq);
 
 } // namespace cfq
@@ -0,0 +1,59 @@
+#include "stage.hpp"
+
+#include <cstddef>
+#include <cstdlib>
+
+#include <thread>
+
+#include <spdlog/spdlog.h>
+
+#include "trace.hpp"
+
+namespace cfq {
+
+int stage(qcmd_t<cmd, kCmdsLen> &qin, qcmd_t<cmd, kCmdsLen> &qout,
+          std::span<celld> cellds, cellc &cellc, transform &tr) {
+  spdlog::info("started");
+
+  for (bool eof = false; !eof;) {
+    if (auto const v = qin.pop()) [[likely]] {
+      CFQ_TRACE_EVENT(trace::ev_pop, *v);
+
+      switch (auto ncell = v->get_fcdn(); v->get_op()) {
+      case op_write: {
+        auto cells_left = v->get_cnum();
+        for (auto *celld = &cellds[ncell];
+             cells_left > 0 && ncell < cellc.cells_len;
+             celld = &cellds[ncell], --cells_left) {
+
+          tr.process({cellc.cells + cellc.cell_sz * ncell, celld->data_sz});
+
+          ncell = celld->ncell;
+        }
+      } break;
+      case op_eof:
+        tr.finish();
+        eof = true;
+        break;
+      default:
+        break;
+      }
+
+      if (!qout.push(*v)) [[unlikely]] {
+        CFQ_TRACE_EVENT(trace::ev_full, *v);
+        while (!qout.push(*v))
+          std::this_thread::yield();
+      }
+
+      CFQ_TRACE_EVENT(trace::ev_push, *v);
+    } else {
+      std::this_thread::yield();
+    }
+  }
+
+  spdlog::info("finished");
+
+  return EXIT_SUCCESS;
+}
+
+} // namespace cfq
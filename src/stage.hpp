@@ -0,0 +1,23 @@
+#pragma once
+
+#include <cstdint>
+
+#include <span>
+
+#include "cellc.hpp"
+#include "celld.hpp"
+#include "cmd.hpp"
+#include "qcmd.hpp"
+#include "transform.hpp"
+
+namespace cfq {
+
+/*
+ * Pipeline stage sitting between producer and consumer: pops commands from
+ * qin, transforms cells of write commands in place and forwards the very same
+ * commands to qout
+ */
+int stage(qcmd_t<cmd, kCmdsLen> &qin, qcmd_t<cmd, kCmdsLen> &qout,
+          std::span<celld> cellds, cellc &cellc, transform &tr);
+
+} // namespace cfq
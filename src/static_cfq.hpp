@@ -0,0 +1,90 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include <bit>
+#include <new>
+#include <optional>
+#include <type_traits>
+
+#include "align.hpp"
+#include "concepts.hpp"
+
+namespace cfq {
+
+/*
+ * Queue with head, tail and items stored inline, so that it can be
+ * placement-constructed right in a shared mapping. Head and tail run freely
+ * and are reduced to an index by masking, thus all N items are usable
+ */
+template <cfq_suitable T, size_t N>
+  requires(N >= 2 && std::has_single_bit(N) &&
+           N <= (size_t{1} << (sizeof(uint32_t) * 8 - 1)))
+class alignas(hardware_destructive_interference_size) static_cfq {
+public:
+  [[nodiscard]] static constexpr size_t capacity() noexcept { return N; }
+
+  /*
+   * Number of items queued, approximate while the other side is active. Head
+   * is loaded first so that the difference never goes negative
+   */
+  [[nodiscard]] size_t size() const noexcept {
+    auto const ph = __atomic_load_n(&head_, __ATOMIC_RELAXED);
+    return __atomic_load_n(&tail_, __ATOMIC_RELAXED) - ph;
+  }
+
+  static_cfq() noexcept = default;
+  ~static_cfq() = default;
+
+  static_cfq(static_cfq const &) = delete;
+  static_cfq operator=(static_cfq const &) = delete;
+
+  static_cfq(static_cfq &&) = delete;
+  static_cfq &operator=(static_cfq &&) = delete;
+
+  std::optional<T> pop() noexcept(std::is_nothrow_copy_constructible_v<T>
+                                      &&std::is_nothrow_destructible_v<T>) {
+    std::optional<T> v;
+
+    auto ph = __atomic_load_n(&head_, __ATOMIC_RELAXED);
+    do {
+      if (auto const pt = __atomic_load_n(&tail_, __ATOMIC_ACQUIRE); pt == ph)
+          [[unlikely]] {
+
+        v.reset();
+        break;
+      }
+      v = items_[ph & kMask];
+    } while (!__atomic_compare_exchange_n(&head_, &ph, ph + 1, true,
+                                          __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+
+    return v;
+  }
+
+  bool push(T const &v) noexcept(std::is_nothrow_copy_constructible_v<T>) {
+    auto const pt = tail_;
+    if (pt - __atomic_load_n(&head_, __ATOMIC_ACQUIRE) == N) [[unlikely]]
+      return false;
+    items_[pt & kMask] = v;
+    __atomic_store_n(&tail_, pt + 1, __ATOMIC_RELEASE);
+    return true;
+  }
+
+private:
+  static constexpr uint32_t kMask = N - 1;
+
+  alignas(hardware_destructive_interference_size) uint32_t head_{0};
+  alignas(hardware_destructive_interference_size) uint32_t tail_{0};
+  alignas(hardware_destructive_interference_size) T items_[N];
+
+  static_assert(sizeof(head_) <= hardware_destructive_interference_size);
+};
+
+/* Constructs an empty queue in place, p must be suitably aligned */
+template <cfq_suitable T, size_t N>
+static_cfq<T, N> *make_static_cfq(void *p) noexcept {
+  return new (p) static_cfq<T, N>{};
+}
+
+} // namespace cfq
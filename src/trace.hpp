@@ -0,0 +1,147 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <string_view>
+#include <thread>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "align.hpp"
+#include "cmd.hpp"
+
+#ifndef CFQ_TRACE
+#define CFQ_TRACE 0
+#endif
+
+/*
+ * Records a fixed-size event in the calling thread's trace ring, no-op if the
+ * thread has no ring attached. Compiled out entirely unless CFQ_TRACE
+ */
+#if CFQ_TRACE
+#define CFQ_TRACE_EVENT(...) ::cfq::trace::emit(__VA_ARGS__)
+#else
+#define CFQ_TRACE_EVENT(...) ((void)0)
+#endif
+
+namespace cfq::trace {
+
+enum : uint16_t {
+  /* cmd has been pushed to the queue */
+  ev_push = 0,
+  /* the queue is full, cmd is to be pushed once there is room */
+  ev_full = 1,
+  /* cmd has been popped off the queue */
+  ev_pop = 2,
+  /* cmd has been carried out by the consumer, arg is bytes written */
+  ev_done = 3,
+  /* the batch tuner changed its mind, arg is the new batch */
+  ev_tune = 4,
+  /* the producer got completion of cmd, arg is its status */
+  ev_cqe = 5,
+
+  evs_qty,
+};
+
+constexpr char const *kEventNames[evs_qty] = {
+    "push", "full", "pop", "done", "tune", "cqe",
+};
+
+struct record {
+  uint64_t tsc;
+  uint16_t ev;
+  uint16_t reserved1;
+  uint32_t arg;
+  cfq::cmd cmd;
+  uint32_t reserved2;
+};
+
+static_assert(sizeof(record) == 32);
+
+constexpr uint64_t kRingMagic = 0x474e495251464321; /* "!CFQRING" */
+constexpr size_t kRingLen = size_t{1} << 14;
+constexpr size_t kRoleLen = 16;
+
+/*
+ * Events of one role, the latest kRingLen of them survive. Written by its
+ * role only, read once the role has finished
+ */
+struct ring {
+  uint64_t magic;
+  char role[kRoleLen];
+  int32_t tid;
+  uint32_t reserved;
+  alignas(hardware_destructive_interference_size) uint64_t head;
+  alignas(hardware_destructive_interference_size) record records[kRingLen];
+};
+
+constexpr uint64_t kFileMagic = 0x4543415254514643; /* "CFQTRACE" */
+
+/* Header of a trace file, followed by nrings rings */
+struct file_header {
+  uint64_t magic;
+  uint32_t nrings;
+  uint32_t reserved;
+  double ticks_per_us;
+};
+
+inline thread_local ring *tls_ring = nullptr;
+
+inline uint64_t ticks() noexcept {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+#endif
+}
+
+/* Measures how many ticks() make a microsecond */
+inline double calibrate() {
+  using clock = std::chrono::steady_clock;
+
+  auto const tp0 = clock::now();
+  auto const t0 = ticks();
+  std::this_thread::sleep_for(std::chrono::milliseconds{10});
+  auto const t1 = ticks();
+  auto const tp1 = clock::now();
+
+  return (t1 - t0) /
+         std::chrono::duration<double, std::micro>(tp1 - tp0).count();
+}
+
+/* Makes the calling thread record its events in r */
+inline void attach(ring *r, std::string_view role) noexcept {
+  if (r) {
+    r->magic = kRingMagic;
+    std::memset(r->role, 0, sizeof(r->role));
+    std::memcpy(r->role, role.data(), std::min(role.size(), kRoleLen - 1));
+    r->tid = gettid();
+    r->head = 0;
+  }
+  tls_ring = r;
+}
+
+inline void emit(uint16_t ev, cmd const &c = {}, uint32_t arg = 0) noexcept {
+  if (auto *r = tls_ring) {
+    r->records[r->head++ & (kRingLen - 1)] = {
+        .tsc = ticks(),
+        .ev = ev,
+        .reserved1 = 0,
+        .arg = arg,
+        .cmd = c,
+        .reserved2 = 0,
+    };
+  }
+}
+
+} // namespace cfq::trace
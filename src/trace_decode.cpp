@@ -0,0 +1,91 @@
+#include <cstdint>
+#include <cstdlib>
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <ios>
+#include <iostream>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+#include <fmt/format.h>
+
+#include "trace.hpp"
+
+namespace {
+
+struct event {
+  cfq::trace::record const *rec;
+  cfq::trace::ring const *ring;
+};
+
+std::string_view event_name(uint16_t ev) noexcept {
+  return ev < cfq::trace::evs_qty ? cfq::trace::kEventNames[ev] : "unknown";
+}
+
+} // namespace
+
+/* Run example: ./ipc-cfq-trace <path/to/trace> */
+int main(int argc, char const *argv[]) {
+  if (2 != argc) {
+    std::cerr << fmt::format("{} <path/to/trace>", argv[0]) << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  std::ifstream f{argv[1], std::ios::in | std::ios::binary};
+
+  cfq::trace::file_header hdr;
+  if (!f.read(reinterpret_cast<char *>(&hdr), sizeof(hdr)) ||
+      cfq::trace::kFileMagic != hdr.magic) {
+    std::cerr << fmt::format("{} is not a trace file", argv[1]) << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  /* Rings are too large for the stack and need their alignment */
+  std::vector<std::unique_ptr<cfq::trace::ring>> rings;
+  for (uint32_t i = 0; i < hdr.nrings; ++i) {
+    auto p_ring = std::make_unique_for_overwrite<cfq::trace::ring>();
+    if (!f.read(reinterpret_cast<char *>(p_ring.get()), sizeof(*p_ring)) ||
+        cfq::trace::kRingMagic != p_ring->magic) {
+      std::cerr << fmt::format("{} is truncated or corrupted", argv[1])
+                << std::endl;
+      return EXIT_FAILURE;
+    }
+    rings.push_back(std::move(p_ring));
+  }
+
+  std::vector<event> events;
+  for (auto const &p_ring : rings) {
+    auto const head = p_ring->head;
+    auto const len = std::min<uint64_t>(head, cfq::trace::kRingLen);
+    if (head > cfq::trace::kRingLen) {
+      std::cout << fmt::format("# {}[{}]: {} oldest events lost",
+                               p_ring->role, p_ring->tid,
+                               head - cfq::trace::kRingLen)
+                << std::endl;
+    }
+    for (auto i = head - len; i < head; ++i) {
+      events.push_back(
+          {&p_ring->records[i & (cfq::trace::kRingLen - 1)], p_ring.get()});
+    }
+  }
+
+  std::ranges::stable_sort(
+      events, {}, [](auto const &event) { return event.rec->tsc; });
+
+  if (events.empty())
+    return EXIT_SUCCESS;
+
+  auto const tsc0 = events.front().rec->tsc;
+  for (auto const &[rec, ring] : events) {
+    std::cout << fmt::format("{:12.3f} {:>10}[{}] {:<5} {} arg={}",
+                             (rec->tsc - tsc0) / hdr.ticks_per_us, ring->role,
+                             ring->tid, event_name(rec->ev), rec->cmd,
+                             rec->arg)
+              << '\n';
+  }
+
+  return EXIT_SUCCESS;
+}
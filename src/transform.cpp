@@ -0,0 +1,82 @@
+#include "transform.hpp"
+
+#include <cstdint>
+
+#include <stdexcept>
+#include <string>
+
+#include <fmt/format.h>
+
+#include <spdlog/spdlog.h>
+
+namespace {
+
+class pass final : public cfq::transform {
+public:
+  void process(std::span<std::byte>) noexcept override {}
+};
+
+class xor_key final : public cfq::transform {
+public:
+  explicit xor_key(std::byte key) noexcept : key_(key) {}
+
+  void process(std::span<std::byte> data) noexcept override {
+    for (auto &b : data)
+      b ^= key_;
+  }
+
+private:
+  std::byte key_;
+};
+
+class fnv1a final : public cfq::transform {
+public:
+  void process(std::span<std::byte> data) noexcept override {
+    for (auto const b : data) {
+      hash_ ^= std::to_integer<uint64_t>(b);
+      hash_ *= 0x100000001b3;
+    }
+  }
+
+  void finish() noexcept override { spdlog::info("fnv1a: {:016x}", hash_); }
+
+private:
+  uint64_t hash_{0xcbf29ce484222325};
+};
+
+} // namespace
+
+namespace cfq {
+
+std::unique_ptr<transform> make_transform(std::string_view spec) {
+  auto const eq = spec.find('=');
+  auto const name = spec.substr(0, eq);
+  auto const arg =
+      eq == std::string_view::npos ? std::string_view{} : spec.substr(eq + 1);
+
+  if (name == "pass" && arg.empty())
+    return std::make_unique<pass>();
+
+  if (name == "fnv1a" && arg.empty())
+    return std::make_unique<fnv1a>();
+
+  if (name == "xor") {
+    uint8_t key = 0xff;
+    if (!arg.empty()) {
+      try {
+        auto const v = std::stoul(std::string{arg}, nullptr, 0);
+        if (v > 0xff)
+          throw std::out_of_range("key must fit in a byte");
+        key = static_cast<uint8_t>(v);
+      } catch (std::exception const &) {
+        throw std::invalid_argument(
+            fmt::format("invalid key in stage spec '{}'", spec));
+      }
+    }
+    return std::make_unique<xor_key>(std::byte{key});
+  }
+
+  throw std::invalid_argument(fmt::format("unknown stage spec '{}'", spec));
+}
+
+} // namespace cfq
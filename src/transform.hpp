@@ -0,0 +1,29 @@
+#pragma once
+
+#include <cstddef>
+
+#include <memory>
+#include <span>
+#include <string_view>
+
+namespace cfq {
+
+/*
+ * In-place transformation applied by a pipeline stage to every data cell
+ * passing through it
+ */
+class transform {
+public:
+  virtual ~transform() = default;
+
+  virtual void process(std::span<std::byte> data) noexcept = 0;
+  virtual void finish() noexcept {}
+};
+
+/*
+ * Builds a transform out of spec given in the form <name>[=<arg>], throws
+ * std::invalid_argument if the spec is unknown or malformed
+ */
+std::unique_ptr<transform> make_transform(std::string_view spec);
+
+} // namespace cfq
@@ -0,0 +1,99 @@
+#include "tuner.hpp"
+
+#include <algorithm>
+
+#include <spdlog/spdlog.h>
+
+#include "trace.hpp"
+
+namespace cfq {
+
+batch_tuner::batch_tuner(uint16_t min_batch, uint16_t max_batch) noexcept
+    : min_batch_(std::max<uint16_t>(min_batch, 1)),
+      max_batch_(std::max(min_batch_, max_batch)),
+      stats_{.batch = min_batch_},
+      last_tp_(clock::now()) {}
+
+uint16_t batch_tuner::update(tuner_sample const &s) noexcept {
+  auto const tp = clock::now();
+  auto const dt = tp - last_tp_;
+  if (dt < kPeriod) [[likely]]
+    return stats_.batch;
+
+  /* Weight of the latest period is 1/4 */
+  auto const secs = std::chrono::duration<double>(dt).count();
+  auto const ewma = [secs](double avg, uint64_t delta) {
+    return avg + (delta / secs - avg) / 4;
+  };
+  stats_.fill_rate = ewma(stats_.fill_rate, s.cells_taken - last_taken_);
+  stats_.drain_rate =
+      ewma(stats_.drain_rate, s.cells_released - last_released_);
+
+  last_tp_ = tp;
+  last_taken_ = s.cells_taken;
+  last_released_ = s.cells_released;
+
+  auto const prev_batch = stats_.batch;
+
+  switch (stats_.last = decide(s)) {
+  case decision::grow:
+    ++stats_.batch;
+    ++stats_.grows;
+    break;
+  case decision::shrink:
+    stats_.batch = std::max<uint16_t>(stats_.batch / 2, min_batch_);
+    ++stats_.shrinks;
+    break;
+  case decision::hold:
+    ++stats_.holds;
+    break;
+  }
+
+  if (prev_batch != stats_.batch) {
+    CFQ_TRACE_EVENT(trace::ev_tune, {}, stats_.batch);
+    spdlog::debug("tuner: {} batch {} -> {}, queued {}/{}, vacant {}, fill "
+                  "{:.0f}/s, drain {:.0f}/s",
+                  to_string(stats_.last), prev_batch, stats_.batch, s.queued,
+                  s.queue_capacity, s.cells_vacant, stats_.fill_rate,
+                  stats_.drain_rate);
+  }
+
+  return stats_.batch;
+}
+
+batch_tuner::decision
+batch_tuner::decide(tuner_sample const &s) const noexcept {
+  auto const in_flight = s.cells_len - std::min(s.cells_vacant, s.cells_len);
+
+  /*
+   * Cells wait for the consumer or commands back up in the queue, smaller
+   * batches get through the pipeline sooner
+   */
+  if (in_flight * 4 >= s.cells_len * 3 ||
+      s.queued * 4 >= s.queue_capacity * 3) {
+    return stats_.batch > min_batch_ ? decision::shrink : decision::hold;
+  }
+
+  /* The consumer drains about as fast as we fill and cells stay idle */
+  if (in_flight * 2 <= s.cells_len && s.queued * 4 <= s.queue_capacity &&
+      stats_.batch < max_batch_ &&
+      stats_.drain_rate * 8 >= stats_.fill_rate * 7) {
+    return decision::grow;
+  }
+
+  return decision::hold;
+}
+
+std::string_view to_string(batch_tuner::decision d) noexcept {
+  switch (d) {
+  case batch_tuner::decision::grow:
+    return "grow";
+  case batch_tuner::decision::shrink:
+    return "shrink";
+  case batch_tuner::decision::hold:
+    break;
+  }
+  return "hold";
+}
+
+} // namespace cfq
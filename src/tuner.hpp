@@ -0,0 +1,72 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include <chrono>
+#include <string_view>
+
+namespace cfq {
+
+/* What the producer observes right before building a command */
+struct tuner_sample {
+  size_t queued;
+  size_t queue_capacity;
+  uint32_t cells_vacant;
+  uint32_t cells_len;
+  uint64_t cells_taken;
+  uint64_t cells_released;
+};
+
+/*
+ * Adapts the number of cells the producer puts in one command: starting from
+ * the smallest batch it grows additively while the consumer keeps up with the
+ * producer and halves once cells or commands back up, so that latency is cut
+ */
+class batch_tuner {
+public:
+  enum class decision : uint8_t {
+    hold,
+    grow,
+    shrink,
+  };
+
+  struct stats {
+    uint16_t batch = 0;
+    uint64_t holds = 0;
+    uint64_t grows = 0;
+    uint64_t shrinks = 0;
+    decision last = decision::hold;
+    /* Exponentially weighted rates, in cells per second */
+    double fill_rate = 0;
+    double drain_rate = 0;
+  };
+
+  using clock = std::chrono::steady_clock;
+
+  static constexpr clock::duration kPeriod = std::chrono::microseconds{200};
+
+  explicit batch_tuner(uint16_t min_batch, uint16_t max_batch) noexcept;
+
+  [[nodiscard]] uint16_t batch() const noexcept { return stats_.batch; }
+  [[nodiscard]] stats const &get_stats() const noexcept { return stats_; }
+
+  /* Feeds a sample in, returns the batch to use for the next command */
+  uint16_t update(tuner_sample const &s) noexcept;
+
+private:
+  decision decide(tuner_sample const &s) const noexcept;
+
+  uint16_t const min_batch_;
+  uint16_t const max_batch_;
+
+  stats stats_;
+
+  clock::time_point last_tp_;
+  uint64_t last_taken_ = 0;
+  uint64_t last_released_ = 0;
+};
+
+std::string_view to_string(batch_tuner::decision d) noexcept;
+
+} // namespace cfq